@@ -0,0 +1,58 @@
+/*
+ * DWT_Profile.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: agent
+ */
+
+#ifndef INC_DWT_PROFILE_H_
+#define INC_DWT_PROFILE_H_
+
+// USER DEFINES User can adjust these defines to fit their project requirements
+#define PROFILE_ENABLE 0 // set to 1 to time the sections below. When 0 the macros compile to nothing
+// END USER DEFINES
+
+enum PROFILE_SECTION
+{
+	PROFILE_RX_ISR, // HAL_UARTEx_RxEventCallback
+	PROFILE_TX_ISR, // HAL_UART_TxCpltCallback
+	PROFILE_PARSE_1,
+	PROFILE_PARSE_2,
+	PROFILE_PARSE_3,
+	PROFILE_PARSE_4,
+	PROFILE_PARSE_LP1,
+	PROFILE_TIMER_CALLBACK, // TimerCallbackCheck
+	PROFILE_POLLING, // one PollingRoutine pass
+	PROFILE_SECTION_COUNT
+};
+
+#define PROFILE_HISTOGRAM_SIZE 32 // bucket n counts times of 2^(n-1) to 2^n - 1 cycles
+#define PROFILE_DUMP_SIZE (80 + PROFILE_HISTOGRAM_SIZE * 14) // text of one section, the stats line plus " bucket:count" for each bucket
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t min; // cycles
+	uint32_t max;
+	uint64_t total; // for the mean
+	uint32_t histogram[PROFILE_HISTOGRAM_SIZE];
+}DWT_ProfileStats;
+
+#if PROFILE_ENABLE
+#define PROFILE_START(section) uint32_t profileStart_##section = DWT->CYCCNT
+#define PROFILE_END(section) DWT_Profile_Record(section, DWT->CYCCNT - profileStart_##section)
+#else
+#define PROFILE_START(section)
+#define PROFILE_END(section)
+#endif
+
+
+void DWT_Profile_Init(void);
+void DWT_Profile_Reset(void);
+void DWT_Profile_Record(uint32_t section, uint32_t cycles);
+DWT_ProfileStats * DWT_Profile_GetStats(uint32_t section);
+void DWT_Profile_Dump(UART_DMA_QueueStruct *msg);
+void DWT_Profile_DumpService(void);
+
+
+#endif /* INC_DWT_PROFILE_H_ */
@@ -8,6 +8,9 @@
 #ifndef INC_POLLINGROUTINE_H_
 #define INC_POLLINGROUTINE_H_
 
+// USER DEFINES User can adjust these defines to fit their project requirements
+#define POLLING_SLEEP_ENABLE 1 // 1 = sleep with WFI when no port has frames to parse, 0 = keep polling
+// END USER DEFINES
 
 void PollingInit(void);
 void PollingRoutine(void);
@@ -15,6 +18,9 @@ void PollingRoutine(void);
 void UART_Parse_1(UART_DMA_QueueStruct * msg);
 void UART_Parse_2(UART_DMA_QueueStruct * msg);
 void UART_Parse_3(UART_DMA_QueueStruct * msg);
+void UART_Parse_4(UART_DMA_QueueStruct * msg);
+void UART_Parse_LP1(UART_DMA_QueueStruct * msg);
+void UART_SendStats(void);
 
 void BlinkGreenLED(void);
 
@@ -12,10 +12,26 @@ typedef struct {
 	uint32_t cnt_OverFlow; // has overflow if not zero
 }RING_BUFF_STRUCT;
 
+// Single producer/single consumer. bufferSize must be a power of 2.
+// The producer (i.e. interrupt) only writes head and the consumer (i.e. polling routine) only writes tail,
+// so no shared counter or interrupt masking is needed.
+typedef struct {
+	volatile uint32_t head; // free running, index_IN is head & (bufferSize - 1)
+	volatile uint32_t tail; // free running, index_OUT is tail & (bufferSize - 1)
+	uint32_t cnt_OverFlow; // number of inputs rejected because buffer was full. Only written by producer
+}RING_BUFF_SPSC_STRUCT;
+
 void RingBuff_Ptr_Reset(RING_BUFF_STRUCT *ptr);
 void RingBuff_Ptr_Input(RING_BUFF_STRUCT *ptr, uint32_t bufferSize);
 void RingBuff_Ptr_Output(RING_BUFF_STRUCT *ptr, uint32_t bufferSize);
 
+void RingBuff_SPSC_Reset(RING_BUFF_SPSC_STRUCT *ptr);
+uint32_t RingBuff_SPSC_IndexIn(RING_BUFF_SPSC_STRUCT *ptr, uint32_t bufferSize);
+uint32_t RingBuff_SPSC_IndexOut(RING_BUFF_SPSC_STRUCT *ptr, uint32_t bufferSize);
+uint32_t RingBuff_SPSC_Count(RING_BUFF_SPSC_STRUCT *ptr);
+int RingBuff_SPSC_Input(RING_BUFF_SPSC_STRUCT *ptr, uint32_t bufferSize);
+int RingBuff_SPSC_Output(RING_BUFF_SPSC_STRUCT *ptr);
+
 
 
 #endif // RING_BUFFER_H
@@ -0,0 +1,38 @@
+/*
+ * UART_Benchmark.h
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: agent
+ */
+
+#ifndef INC_UART_BENCHMARK_H_
+#define INC_UART_BENCHMARK_H_
+
+// USER DEFINES User can adjust these defines to fit their project requirements
+#define UART_BENCHMARK_ENABLE 0 // set to 1 to run the benchmark instead of the normal parsing
+#define UART_BENCHMARK_PORTS_MAX 5
+#define UART_BENCHMARK_CHUNK_SIZE UART_DMA_DATA_SIZE // bytes per queued message
+#define UART_BENCHMARK_INTERVAL 1000 // ms between reports
+#define UART_BENCHMARK_REPORT_RESERVE 512 // tx ring bytes kept free on the report port for the report
+// END USER DEFINES
+
+typedef struct
+{
+	UART_DMA_QueueStruct *port[UART_BENCHMARK_PORTS_MAX];
+	uint32_t portCount;
+	UART_DMA_QueueStruct *report; // port the results are sent to
+	bool calibrated; // false during the first interval, which runs without traffic to measure the idle loop rate
+	uint32_t idleLoops; // polling loops per interval with no traffic
+	uint32_t loops; // polling loops in this interval
+	uint32_t startTick;
+	uint32_t txBytes[UART_BENCHMARK_PORTS_MAX];
+	uint32_t rxBytes[UART_BENCHMARK_PORTS_MAX];
+}UART_BenchmarkStruct;
+
+
+void UART_BenchmarkInit(UART_BenchmarkStruct *bench, UART_DMA_QueueStruct *report);
+int UART_BenchmarkAddPort(UART_BenchmarkStruct *bench, UART_DMA_QueueStruct *port);
+void UART_BenchmarkRun(UART_BenchmarkStruct *bench);
+
+
+#endif /* INC_UART_BENCHMARK_H_ */
@@ -9,47 +9,276 @@
 #define INC_UART_DMA_HANDLER_H_
 
 // USER DEFINES User can adjust these defines to fit their project requirements
-#define UART_DMA_DATA_SIZE 128
-#define UART_DMA_QUEUE_SIZE 8
+#define UART_DMA_DATA_SIZE 128 // tx fragment size. Longer messages are split into fragments of this size
+#define UART_DMA_RX_SMALL_SIZE 32 // rx frames up to this size are stored in a small slot
+#define UART_DMA_RX_SMALL_COUNT 12
+#define UART_DMA_RX_LARGE_SIZE 256 // max rx frame size. Longer frames are split across large slots
+#define UART_DMA_RX_LARGE_COUNT 3 // at least 3
+#define UART_DMA_TX_RING_SIZE 1280 // tx ring bytes per port, for all priorities. Messages are packed back to back
+#define UART_DMA_TX_PRIORITIES 2 // tx priority classes per port, each has its own ring. The highest non empty one is sent first
+#define UART_DMA_TX_URGENT_RING_SIZE 256 // taken from UART_DMA_TX_RING_SIZE for each priority above normal. Must be a power of 2
+#define UART_DMA_RX_CIRC_SIZE 256 // circular DMA buffer size per port. Only used if rx.circularMode is true
+#define UART_DMA_TX_BUFFER_POOL_SIZE 8 // number of zero copy tx buffers shared by all ports
+#define UART_DMA_TX_BUFFER_SIZE 128 // data size of each pooled tx buffer
+#define UART_DMA_TX_COALESCE_SIZE 256 // max bytes merged into one transfer. Only used if tx.coalesceMode is true
+#define UART_DMA_TX_MAILBOX_COUNT 4 // latest value tx slots per port, one per key. See UART_DMA_TX_MailboxPut
+#define UART_DMA_TX_MAILBOX_SIZE 32 // max value size of a mailbox slot. No more than UART_DMA_TX_COALESCE_SIZE
+#define UART_DMA_RTS_OFF_FREE_SLOTS 4 // RTS is deasserted when fewer rx slots than this are free. Only used if rx.rtsPort is set
+#define UART_DMA_RTS_ON_FREE_SLOTS 8 // RTS is asserted again when at least this many rx slots are free
+#define UART_DMA_BAUD_MAX_ERROR_PPM 20000 // UART_DMA_SetBaudRate rejects a baud rate with more error than this (2%)
+#define UART_DMA_STATS_SAMPLE_TIME 250 // ms between byte count samples for the bytes per second
+#define UART_DMA_STATS_SAMPLES 4 // bytes per second is averaged over UART_DMA_STATS_SAMPLES * UART_DMA_STATS_SAMPLE_TIME
+#define UART_DMA_PORT_RAM_MAX 4096 // build fails if a UART_DMA_QueueStruct is larger than this many bytes
 // END USER DEFINES
 // **************************************************
 // ********* Do not modify code below here **********
 // **************************************************
+#define UART_DMA_QUEUE_SIZE 16 // rx queue. Must be a power of 2 and at least UART_DMA_RX_SMALL_COUNT + UART_DMA_RX_LARGE_COUNT
+#define UART_DMA_TX_MAX_TRANSFER 0xFFFF // max bytes per DMA transfer. Larger zero copy buffers are sent as several transfers
+#define UART_DMA_TX_NORMAL_RING_SIZE (UART_DMA_TX_RING_SIZE - (UART_DMA_TX_PRIORITIES - 1) * UART_DMA_TX_URGENT_RING_SIZE) // what is left for the normal priority ring. Must be a power of 2
+
+enum UART_DMA_RX_CLASS
+{
+	UART_DMA_RX_SMALL,
+	UART_DMA_RX_LARGE
+};
+
+enum UART_DMA_RX_POLICY
+{
+	UART_DMA_RX_DROP_NEWEST = 0, // default. The new frame is dropped
+	UART_DMA_RX_DROP_OLDEST, // frames are dropped from the front of the rx queue to free a slot for the new frame
+	UART_DMA_RX_REJECT // the new frame is dropped and RTS is deasserted right away
+};
+
+enum UART_DMA_TX_PRIORITY
+{
+	UART_DMA_TX_PRIORITY_NORMAL = 0, // used by all the send functions that don't take a priority
+	UART_DMA_TX_PRIORITY_URGENT = UART_DMA_TX_PRIORITIES - 1 // i.e. fault notifications, sent before anything else in the ring
+};
+
 typedef struct
 {
-	uint8_t data[UART_DMA_DATA_SIZE];
+	uint8_t *data;
+	uint16_t size;
+	uint8_t sizeClass; // UART_DMA_RX_SMALL or UART_DMA_RX_LARGE
+	uint8_t slot;
+	bool more; // true = this is part of a frame, the rest follows in the next frame
+}UART_DMA_RxFrame; // this is used in rx queue structure
+
+typedef struct UART_DMA_TxBuffer UART_DMA_TxBuffer;
+typedef void (*UART_DMA_TxBufferCallback)(UART_DMA_TxBuffer *buffer);
+
+struct UART_DMA_TxBuffer
+{
+	uint8_t *data; // DMA transmits directly from here
 	uint32_t size;
-}UART_DMA_Data; // this is used in queue structure
+	uint32_t refCount; // buffer is free when 0
+	UART_DMA_TxBufferCallback release; // optional, called when refCount reaches 0. If NULL the buffer goes back to the pool
+	void *owner; // optional, for use by the release callback
+}; // zero copy tx buffer descriptor
+
+typedef struct
+{
+	uint32_t rxFrames; // frames queued or bridged
+	uint32_t rxBytes;
+	uint32_t rxBusyRetries; // times UART_DMA_CheckRxInterruptErrorFlag had to enable rx again
+	uint32_t rxQueueHighWater; // max frames waiting in the rx queue
+	uint32_t txMessages; // messages added to the tx ring
+	uint32_t txTransfers; // DMA transfers started
+	uint32_t txBytes; // bytes sent
+	uint32_t txRingHighWater; // max tx ring bytes in use, of any priority
+	uint32_t txLatencyTotal[UART_DMA_TX_PRIORITIES]; // ms from queued to the start of its transfer, added up per priority
+	uint32_t txLatencyCount[UART_DMA_TX_PRIORITIES];
+	uint32_t txLatencyMax[UART_DMA_TX_PRIORITIES];
+	uint32_t txMailboxSent; // mailbox values sent
+	uint32_t txMailboxReplaced; // mailbox values replaced by a newer one before they were sent
+	uint32_t txExpired; // messages dropped because their time to live ran out before they were sent
+	uint32_t rxBytesPerSecond;
+	uint32_t txBytesPerSecond;
+	uint32_t sampleTick;
+	uint32_t sampleIndex;
+	uint32_t rxSample[UART_DMA_STATS_SAMPLES]; // rxBytes at each of the last samples
+	uint32_t txSample[UART_DMA_STATS_SAMPLES];
+}UART_DMA_Stats; // counters are only added to, so each can be read at any time without disabling interrupts
+
+typedef struct __attribute__((packed))
+{
+	uint8_t sync[2]; // 0xA5 0x5A
+	uint8_t version; // UART_DMA_STATS_VERSION
+	uint8_t port; // id given to UART_DMA_StatsSend
+	uint32_t rxFrames;
+	uint32_t rxBytes;
+	uint32_t rxOverflow;
+	uint32_t rxBusyRetries;
+	uint32_t rxQueueHighWater;
+	uint32_t rxSmallHighWater;
+	uint32_t rxLargeHighWater;
+	uint32_t rxBytesPerSecond;
+	uint32_t txMessages;
+	uint32_t txTransfers;
+	uint32_t txBytes;
+	uint32_t txOverflow;
+	uint32_t txRingHighWater;
+	uint32_t txBytesPerSecond;
+	uint32_t txLatencyMean[UART_DMA_TX_PRIORITIES]; // ms, lowest priority first
+	uint32_t txLatencyMax[UART_DMA_TX_PRIORITIES];
+	uint32_t txExpired;
+	uint8_t checksum; // all bytes before it added together, little endian fields
+}UART_DMA_StatsPacket; // binary snapshot sent by UART_DMA_StatsSend
+
+#define UART_DMA_STATS_VERSION 3
 
 typedef struct
+{
+	uint32_t baudRate; // requested
+	uint32_t actualBaud; // what the BRR value gives
+	int32_t errorPpm; // (actualBaud - baudRate) in parts per million
+	uint32_t overSampling; // UART_OVERSAMPLING_16 or UART_OVERSAMPLING_8. Not used by LPUART
+	uint32_t clockPrescaler; // UART_PRESCALER_DIVx
+}UART_DMA_BaudConfig;
+
+typedef struct
+{
+	const uint8_t *data;
+	uint32_t size;
+}UART_DMA_TxSegment; // one part of a message for UART_DMA_TX_SendSegments
+
+typedef struct
+{
+	uint8_t *ring; // each message is a header followed by the data. Set by UART_DMA_Register
+	uint32_t size; // UART_DMA_TX_NORMAL_RING_SIZE or UART_DMA_TX_URGENT_RING_SIZE
+	uint32_t head; // free running write index, only changed when adding a message
+	uint32_t tail; // free running read index, only changed on tx complete or when an expired message is dropped
+	uint32_t baudSwitchAt; // ring index of the first message sent at the new baud rate
+	uint32_t reservedPad; // pad written by UART_DMA_TX_Reserve, head is moved past it by UART_DMA_TX_Commit
+	bool dropping; // the message at tail expired, the rest of its fragments are dropped too
+}UART_DMA_TxQueue; // one per tx priority
+
+typedef struct
+{
+	uint8_t data[UART_DMA_TX_MAILBOX_SIZE];
+	uint32_t size;
+	uint16_t key; // message id
+	bool used; // slot is assigned to key
+	bool pending; // data hasn't been sent yet
+}UART_DMA_TxMailbox; // latest value of one message id
+
+typedef struct UART_DMA_QueueStruct UART_DMA_QueueStruct;
+typedef void (*UART_DMA_PortCallback)(UART_DMA_QueueStruct *msg);
+
+struct UART_DMA_QueueStruct
 {
 	UART_HandleTypeDef *huart;
 	struct
 	{
-		UART_DMA_Data queue[UART_DMA_QUEUE_SIZE];
-		UART_DMA_Data *msgToParse;
-		RING_BUFF_STRUCT ptr;
-		uint32_t queueSize;
+		UART_DMA_RxFrame queue[UART_DMA_QUEUE_SIZE];
+		UART_DMA_RxFrame *msgToParse; // released on the next call to UART_DMA_MsgRdy
+		RING_BUFF_SPSC_STRUCT ptr; // interrupt is the producer, UART_DMA_MsgRdy is the consumer
+		UART_DMA_PortCallback callback; // optional, called from UART_DMA_Dispatch when frames are ready, i.e. the parser
+		uint32_t queueSize; // must be a power of 2
 		HAL_StatusTypeDef hal_status;
+		uint8_t small[UART_DMA_RX_SMALL_COUNT][UART_DMA_RX_SMALL_SIZE];
+		uint8_t large[UART_DMA_RX_LARGE_COUNT][UART_DMA_RX_LARGE_SIZE];
+		bool smallUsed[UART_DMA_RX_SMALL_COUNT]; // set in interrupt, cleared by UART_DMA_MsgRdy
+		bool largeUsed[UART_DMA_RX_LARGE_COUNT];
+		uint32_t smallHighWater; // max small slots in use at once
+		uint32_t largeHighWater; // max large slots in use at once
+		uint32_t overflow; // frames dropped because there was no free slot
+		uint32_t policy; // UART_DMA_RX_POLICY, what happens to a new frame when no slot is free. See UART_DMA_RxNoSlot
+		uint32_t rejected; // times a frame was rejected with UART_DMA_RX_REJECT
+		uint32_t acquired; // frames at the front of the queue handed to the parser, UART_DMA_RX_DROP_OLDEST drops nothing while there are any
+		bool armed; // normal mode, the DMA is receiving into large[armedSlot]
+		uint8_t armedSlot;
+		bool circularMode; // true = one continuous circular DMA into circBuffer, frames are copied out on each rx event
+		uint8_t circBuffer[UART_DMA_RX_CIRC_SIZE];
+		uint32_t circIndex; // position in circBuffer of the next byte not yet copied to the queue
+		uint32_t cutThroughSize; // circular mode only. 0 = off, otherwise the bytes received so far are queued on half transfer,
+								// transfer complete and when this many bytes are waiting, without waiting for idle
+		UART_DMA_QueueStruct *bridge; // if not NULL, frames are sent by this port from the interrupt instead of being queued
+		UART_DMA_TxBuffer bridgeBuffer[UART_DMA_RX_SMALL_COUNT + UART_DMA_RX_LARGE_COUNT]; // one per slot, small slots first
+		GPIO_TypeDef *rtsPort; // optional, RTS driven from the free rx slots. Configure the pin as GPIO output, not as USART RTS
+		uint16_t rtsPin;
+		bool rtsDeasserted; // true = RTS pin is high, the other end should stop sending
+		uint32_t rtsDeassertCount; // number of times RTS was deasserted
+		bool autoBaud; // true = waiting for auto baud detection, rx and tx are held until it is done
+		bool autoBaudArmed; // detection is running, set once tx was idle
+		uint32_t autoBaudMode; // UART_ADVFEATURE_AUTOBAUDRATE_ONxxx given to UART_DMA_AutoBaudStart
+		uint32_t autoBaudRate; // detected baud rate, 0 until detected
+		uint32_t autoBaudErrors; // detections that failed and were restarted
 	}rx;
 	struct
 	{
-		UART_DMA_Data queue[UART_DMA_QUEUE_SIZE];
-		RING_BUFF_STRUCT ptr;
-		uint32_t queueSize;
+		UART_DMA_TxQueue queue[UART_DMA_TX_PRIORITIES]; // index is the priority, UART_DMA_TX_PRIORITY_NORMAL is 0
+		uint8_t normalRing[UART_DMA_TX_NORMAL_RING_SIZE] __attribute__((aligned(4)));
+		uint8_t urgentRing[UART_DMA_TX_PRIORITIES - 1][UART_DMA_TX_URGENT_RING_SIZE] __attribute__((aligned(4)));
+		UART_DMA_PortCallback callback; // optional, called from UART_DMA_Dispatch after a transfer completes, i.e. to add more messages
+		uint32_t inFlightBytes; // ring bytes used by the transfer in progress, freed on tx complete
+		uint32_t inFlightPriority; // ring the transfer in progress is from
+		uint32_t overflow; // messages rejected because the ring was full
+		UART_DMA_TxBuffer *bufferInFlight; // zero copy buffer being transmitted, released on tx complete
 		bool txPending;
+		bool coalesceMode; // true = pending messages are merged into coalesceBuffer and sent as one transfer
+		uint8_t coalesceBuffer[UART_DMA_TX_COALESCE_SIZE];
+		uint32_t coalescedMessages; // number of messages that were sent as part of a merged transfer
+		uint32_t interruptsSaved; // number of DMA transfers and TC interrupts saved by merging
+		UART_DMA_TxMailbox mailbox[UART_DMA_TX_MAILBOX_COUNT];
+		uint32_t mailboxNext; // slot checked first for the next mailbox transfer, so every key gets a turn
+		bool mailboxLast; // the last transfer was a mailbox value, the normal priority ring goes next
+		UART_DMA_TxBuffer *bridgeQueue[UART_DMA_QUEUE_SIZE]; // rx slots of the bridge source, sent before the ring
+		RING_BUFF_SPSC_STRUCT bridgePtr; // source rx interrupt is the producer, UART_DMA_SendMessage is the consumer
+		UART_DMA_QueueStruct *bridgeSource;
+		bool baudPending; // baudConfig is applied once the messages queued before it are sent
+		volatile bool baudReady; // set on tx complete when they are sent, baudConfig is applied from the main loop
+		UART_DMA_BaudConfig baudConfig;
+		uint32_t baudRequested; // baud rate sent with UART_DMA_BaudNegotiate, waiting for BAUD OK
 	}tx;
-}UART_DMA_QueueStruct;
+	UART_DMA_Stats stats;
+};
 
 
-void UART_DMA_Init(UART_DMA_QueueStruct *msg, UART_HandleTypeDef *huart);
+int UART_DMA_Init(UART_DMA_QueueStruct *msg, UART_HandleTypeDef *huart);
+int UART_DMA_Register(UART_DMA_QueueStruct *msg);
+UART_DMA_QueueStruct * UART_DMA_GetPort(UART_HandleTypeDef *huart);
+uint32_t UART_DMA_PortMask(UART_DMA_QueueStruct *msg);
+void UART_DMA_Dispatch(void);
+void UART_DMA_CheckAllPorts(void);
+void UART_DMA_Sleep(void);
 void UART_DMA_EnableRxInterrupt(UART_DMA_QueueStruct *msg);
 void UART_DMA_CheckRxInterruptErrorFlag(UART_DMA_QueueStruct *msg);
+void UART_DMA_RxEvent(UART_DMA_QueueStruct *msg, uint16_t size);
 int UART_DMA_MsgRdy(UART_DMA_QueueStruct *msg);
-void UART_DMA_NotifyUser(UART_DMA_QueueStruct *msg, char *str, uint32_t size, bool lineFeed);
+UART_DMA_RxFrame * UART_DMA_RxAcquire(UART_DMA_QueueStruct *msg);
+uint32_t UART_DMA_RxAcquireAll(UART_DMA_QueueStruct *msg, UART_DMA_RxFrame *frames[], uint32_t maxFrames);
+void UART_DMA_RxRelease(UART_DMA_QueueStruct *msg, uint32_t count);
+int UART_DMA_Bridge(UART_DMA_QueueStruct *from, UART_DMA_QueueStruct *to);
+int UART_DMA_CalcBaudRate(UART_HandleTypeDef *huart, uint32_t baudRate, UART_DMA_BaudConfig *config);
+int UART_DMA_SetBaudRate(UART_DMA_QueueStruct *msg, uint32_t baudRate, UART_DMA_BaudConfig *config);
+int UART_DMA_BaudNegotiate(UART_DMA_QueueStruct *msg, uint32_t baudRate);
+bool UART_DMA_BaudCommand(UART_DMA_QueueStruct *msg, UART_DMA_RxFrame *frame);
+int UART_DMA_AutoBaudStart(UART_DMA_QueueStruct *msg, uint32_t mode);
+void UART_DMA_StatsReset(UART_DMA_QueueStruct *msg);
+int UART_DMA_StatsSend(UART_DMA_QueueStruct *to, UART_DMA_QueueStruct *msg, uint8_t port);
+int UART_DMA_NotifyUser(UART_DMA_QueueStruct *msg, char *str, uint32_t size, bool lineFeed);
 
-void UART_DMA_TX_AddMessageToBuffer(UART_DMA_QueueStruct *msg, uint8_t *data, uint32_t size);
+// ring sends report no completion, a message split into CONTINUED fragments included. Use UART_DMA_TX_SendBlock to get a done callback
+int UART_DMA_TX_AddMessageToBuffer(UART_DMA_QueueStruct *msg, uint8_t *data, uint32_t size);
+int UART_DMA_TX_SendSegments(UART_DMA_QueueStruct *msg, const UART_DMA_TxSegment *segments, uint32_t count);
+int UART_DMA_TX_SendPriority(UART_DMA_QueueStruct *msg, uint32_t priority, const UART_DMA_TxSegment *segments, uint32_t count);
+int UART_DMA_TX_SendTimed(UART_DMA_QueueStruct *msg, uint32_t priority, uint32_t timeToLive, const UART_DMA_TxSegment *segments, uint32_t count);
+int UART_DMA_TX_MailboxPut(UART_DMA_QueueStruct *msg, uint16_t key, const uint8_t *data, uint32_t size);
+int UART_DMA_Printf(UART_DMA_QueueStruct *msg, const char *format, ...);
+uint32_t UART_DMA_Sprintf(char *buf, uint32_t size, const char *format, ...);
 void UART_DMA_SendMessage(UART_DMA_QueueStruct * msg);
+uint32_t UART_DMA_TX_GetFreeBytes(UART_DMA_QueueStruct *msg);
+uint32_t UART_DMA_TX_GetMaxMessageSize(UART_DMA_QueueStruct *msg);
+bool UART_DMA_TX_IsClearToSend(UART_DMA_QueueStruct *msg);
+void UART_DMA_TxCplt(UART_DMA_QueueStruct *msg);
+
+UART_DMA_TxBuffer * UART_DMA_TxBufferAlloc(void);
+void UART_DMA_TxBufferRetain(UART_DMA_TxBuffer *buffer);
+void UART_DMA_TxBufferRelease(UART_DMA_TxBuffer *buffer);
+int UART_DMA_TX_AddBufferToQueue(UART_DMA_QueueStruct *msg, UART_DMA_TxBuffer *buffer);
+int UART_DMA_TX_SendBlock(UART_DMA_QueueStruct *msg, UART_DMA_TxBuffer *block, const uint8_t *data, uint32_t size, UART_DMA_TxBufferCallback done);
 
 
 #endif /* INC_UART_DMA_HANDLER_H_ */
@@ -42,6 +42,8 @@ extern "C" {
 #include "UART_DMA_Handler_STM32.h"
 #include "PollingRoutine.h"
 #include "TimerCallback.h"
+#include "UART_Benchmark.h"
+#include "DWT_Profile.h"
 /* USER CODE END Includes */
 
 /* Exported types ------------------------------------------------------------*/
@@ -0,0 +1,173 @@
+/*
+ * DWT_Profile.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: agent
+ *
+ *      Times code sections with the Cortex-M4 DWT cycle counter. At 170 MHz one cycle is 5.9 ns
+ *      and the 32 bit counter wraps after 25 seconds, so a section can't be longer than that.
+ *
+ *      Wrap the section with PROFILE_START and PROFILE_END in the same scope.
+ *      	PROFILE_START(PROFILE_PARSE_1);
+ *      	UART_Parse_1(&uart1);
+ *      	PROFILE_END(PROFILE_PARSE_1);
+ *
+ */
+
+#include "main.h"
+#include "DWT_Profile.h"
+
+
+static const char *profileName[PROFILE_SECTION_COUNT] =
+{
+	"RX ISR",
+	"TX ISR",
+	"Parse 1",
+	"Parse 2",
+	"Parse 3",
+	"Parse 4",
+	"Parse LP1",
+	"TimerCallback",
+	"Polling"
+};
+
+static DWT_ProfileStats profileStats[PROFILE_SECTION_COUNT];
+
+static UART_DMA_QueueStruct *profileDumpPort; // not NULL while a dump is in progress
+static uint32_t profileDumpSection;
+static UART_DMA_TxBuffer profileDumpBlock;
+static char profileDumpBuffer[PROFILE_DUMP_SIZE]; // one section, sent without a copy
+static volatile bool profileDumpBusy; // profileDumpBuffer is being sent
+
+static void DWT_Profile_DumpSent(UART_DMA_TxBuffer *buffer);
+
+
+/*
+ * Description: Enable the DWT cycle counter and clear the stats. Call once before the first section is timed.
+ *
+ */
+void DWT_Profile_Init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	DWT_Profile_Reset();
+}
+
+void DWT_Profile_Reset(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint32_t i;
+
+	__disable_irq();
+	memset(profileStats, 0, sizeof(profileStats));
+	for(i = 0; i < PROFILE_SECTION_COUNT; i++)
+	{
+		profileStats[i].min = UINT32_MAX;
+	}
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Description: Called by PROFILE_END. Each section must only be timed from one context, i.e. only from interrupt.
+ *
+ */
+void DWT_Profile_Record(uint32_t section, uint32_t cycles)
+{
+	DWT_ProfileStats *stats = &profileStats[section];
+	uint32_t bucket = 32 - __CLZ(cycles); // 0 for 0 cycles
+
+	if(bucket >= PROFILE_HISTOGRAM_SIZE)
+	{
+		bucket = PROFILE_HISTOGRAM_SIZE - 1;
+	}
+
+	stats->count++;
+	stats->total += cycles;
+	if(cycles < stats->min)
+	{
+		stats->min = cycles;
+	}
+	if(cycles > stats->max)
+	{
+		stats->max = cycles;
+	}
+	stats->histogram[bucket]++;
+}
+
+DWT_ProfileStats * DWT_Profile_GetStats(uint32_t section)
+{
+	return &profileStats[section];
+}
+
+/*
+ * Description: Start sending the stats of every section as text. The text doesn't fit in the tx ring at once,
+ * 				so DWT_Profile_DumpService sends a section each time the previous one is out.
+ *
+ */
+void DWT_Profile_Dump(UART_DMA_QueueStruct *msg)
+{
+	profileDumpSection = 0;
+	profileDumpPort = msg;
+
+#if !PROFILE_ENABLE
+	UART_DMA_Printf(msg, "profile disabled, set PROFILE_ENABLE to 1\r\n");
+	profileDumpPort = NULL;
+#endif
+}
+
+/*
+ * Description: Call from polling routine
+ * 				Each section is 2 lines, name count min mean max in cycles, then the histogram as bucket:count.
+ * 				Bucket n is 2^(n-1) to 2^n - 1 cycles, only buckets with a count are sent.
+ * 				A section is formatted into profileDumpBuffer and sent as one block. If the tx ring is full
+ * 				the same section is tried again on the next call, so nothing is lost.
+ *
+ */
+void DWT_Profile_DumpService(void)
+{
+	DWT_ProfileStats *stats;
+	uint32_t length;
+	uint32_t i;
+
+	if(profileDumpPort == NULL || profileDumpBusy)
+	{
+		return; // nothing to send or the previous section is still going out
+	}
+
+	stats = &profileStats[profileDumpSection];
+	if(stats->count)
+	{
+		length = UART_DMA_Sprintf(profileDumpBuffer, sizeof(profileDumpBuffer), "%s n %u min %u mean %u max %u\r\n",
+				profileName[profileDumpSection], stats->count, stats->min, (uint32_t)(stats->total / stats->count), stats->max);
+		for(i = 0; i < PROFILE_HISTOGRAM_SIZE; i++)
+		{
+			if(stats->histogram[i])
+			{
+				length += UART_DMA_Sprintf(&profileDumpBuffer[length], sizeof(profileDumpBuffer) - length, " %u:%u", i, stats->histogram[i]);
+			}
+		}
+		length += UART_DMA_Sprintf(&profileDumpBuffer[length], sizeof(profileDumpBuffer) - length, "\r\n");
+
+		profileDumpBusy = true;
+		if(UART_DMA_TX_SendBlock(profileDumpPort, &profileDumpBlock, (uint8_t *)profileDumpBuffer, length, DWT_Profile_DumpSent) != 0)
+		{
+			return; // DWT_Profile_DumpSent was already called, try this section again
+		}
+	}
+
+	if(++profileDumpSection >= PROFILE_SECTION_COUNT)
+	{
+		profileDumpPort = NULL;
+	}
+}
+
+/*
+ * Description: Called from tx complete once the section is sent, or right away if it couldn't be queued.
+ *
+ */
+static void DWT_Profile_DumpSent(UART_DMA_TxBuffer *buffer)
+{
+	profileDumpBusy = false;
+}
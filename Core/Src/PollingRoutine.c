@@ -10,6 +10,8 @@
 extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart2; // VCP
 extern UART_HandleTypeDef huart3;
+extern UART_HandleTypeDef huart4;
+extern UART_HandleTypeDef hlpuart1;
 
 extern TimerCallbackStruct timerCallback;
 
@@ -18,131 +20,245 @@ UART_DMA_QueueStruct uart1 =
 {
 	.huart = &huart1,
 	.rx.queueSize = UART_DMA_QUEUE_SIZE,
-	.tx.queueSize = UART_DMA_QUEUE_SIZE,
+	.rx.callback = UART_Parse_1,
+	.tx.coalesceMode = true
 };
 
 UART_DMA_QueueStruct uart2 =
 {
 	.huart = &huart2,
 	.rx.queueSize = UART_DMA_QUEUE_SIZE,
-	.tx.queueSize = UART_DMA_QUEUE_SIZE
+	.rx.callback = UART_Parse_2,
+	.tx.coalesceMode = true
 };
 
 UART_DMA_QueueStruct uart3 =
 {
 	.huart = &huart3,
 	.rx.queueSize = UART_DMA_QUEUE_SIZE,
-	.tx.queueSize = UART_DMA_QUEUE_SIZE
+	.rx.callback = UART_Parse_3,
+	.tx.coalesceMode = true
 };
 
+UART_DMA_QueueStruct uart4 =
+{
+	.huart = &huart4,
+	.rx.queueSize = UART_DMA_QUEUE_SIZE,
+	.rx.callback = UART_Parse_4,
+	.tx.coalesceMode = true
+};
+
+UART_DMA_QueueStruct lpuart1 =
+{
+	.huart = &hlpuart1,
+	.rx.queueSize = UART_DMA_QUEUE_SIZE,
+	.rx.callback = UART_Parse_LP1,
+	.tx.coalesceMode = true
+};
+
+#if UART_BENCHMARK_ENABLE
+UART_BenchmarkStruct benchmark;
+#endif
+
 
 void PollingInit(void)
 {
+	DWT_Profile_Init();
+
 	TimerCallbackRegisterOnly(&timerCallback, BlinkGreenLED);
 	TimerCallbackTimerStart(&timerCallback, BlinkGreenLED, 500, TIMER_REPEAT);
 
-	uart1.rx.msgToParse->size = 0;
 
+	UART_DMA_Register(&uart1);
+	UART_DMA_Register(&uart2);
+	UART_DMA_Register(&uart3);
+	UART_DMA_Register(&uart4);
+	UART_DMA_Register(&lpuart1);
 
 	UART_DMA_EnableRxInterrupt(&uart1);
 	UART_DMA_EnableRxInterrupt(&uart2);
 	UART_DMA_EnableRxInterrupt(&uart3);
+	UART_DMA_EnableRxInterrupt(&uart4);
+	UART_DMA_EnableRxInterrupt(&lpuart1);
+
+	//UART_DMA_Bridge(&uart2, &uart1); // optional, send everything received on uart2 out uart1 without UART_Parse_2
+	//UART_DMA_BaudNegotiate(&uart1, 921600); // optional, uart1 and uart3 are wired together, only their parsers answer BAUD commands
+	//UART_DMA_AutoBaudStart(&uart4, UART_ADVFEATURE_AUTOBAUDRATE_ON0X7FFRAME); // optional, lock onto the rate of a 0x7F sent by the other end
+
+#if UART_BENCHMARK_ENABLE
+	UART_BenchmarkInit(&benchmark, &uart2);
+	UART_BenchmarkAddPort(&benchmark, &uart1);
+	UART_BenchmarkAddPort(&benchmark, &uart2);
+	UART_BenchmarkAddPort(&benchmark, &uart3);
+	UART_BenchmarkAddPort(&benchmark, &uart4);
+	UART_BenchmarkAddPort(&benchmark, &lpuart1);
+#endif
 
 	UART_DMA_NotifyUser(&uart2, "STM32 ready", strlen("STM32 ready"), true);
 }
 
 void PollingRoutine(void)
 {
-	TimerCallbackCheck(&timerCallback);
-
-	UART_DMA_CheckRxInterruptErrorFlag(&uart1);
-	UART_DMA_CheckRxInterruptErrorFlag(&uart2);
-	UART_DMA_CheckRxInterruptErrorFlag(&uart3);
-	UART_Parse_1(&uart1);
-	UART_Parse_2(&uart2);
-	UART_Parse_3(&uart3);
+	static uint32_t lastTick;
+	uint32_t tick = HAL_GetTick();
+
+	PROFILE_START(PROFILE_POLLING);
+
+	if(tick != lastTick) // once per SysTick, for the timers and for work that isn't started by an interrupt
+	{
+		lastTick = tick;
+
+		PROFILE_START(PROFILE_TIMER_CALLBACK);
+		TimerCallbackCheck(&timerCallback);
+		PROFILE_END(PROFILE_TIMER_CALLBACK);
+
+		UART_DMA_CheckAllPorts();
+
+		DWT_Profile_DumpService();
+	}
+
+#if UART_BENCHMARK_ENABLE
+	UART_BenchmarkRun(&benchmark); // benchmark drains every port on every pass
+#else
+	UART_DMA_Dispatch(); // calls rx.callback, the UART_Parse_x below, only for ports with frames ready
+#endif
+
+	PROFILE_END(PROFILE_POLLING);
+
+#if POLLING_SLEEP_ENABLE && !UART_BENCHMARK_ENABLE // the benchmark keeps the tx rings full, it needs every loop
+	UART_DMA_Sleep();
+#endif
 }
 
 void UART_Parse_1(UART_DMA_QueueStruct * msg)
 {
 	char str[] = "UART1_RX Received from UART3_TX > PARSE > Out to UART2_TX > Docklight";
+	UART_DMA_RxFrame *frames[UART_DMA_QUEUE_SIZE];
+	uint32_t count;
+	uint32_t i;
+
+	PROFILE_START(PROFILE_PARSE_1);
 
-	if(UART_DMA_MsgRdy(msg))
+	count = UART_DMA_RxAcquireAll(msg, frames, UART_DMA_QUEUE_SIZE);
+	for(i = 0; i < count; i++)
 	{
+		if(UART_DMA_BaudCommand(msg, frames[i]))
+		{
+			continue;
+		}
 		UART_DMA_NotifyUser(&uart2, str, strlen(str), true);
-		UART_DMA_NotifyUser(&uart2, (char*)msg->rx.msgToParse->data, msg->rx.msgToParse->size, false);
+		UART_DMA_NotifyUser(&uart2, (char*)frames[i]->data, frames[i]->size, false);
 	}
+	UART_DMA_RxRelease(msg, count);
+
+	PROFILE_END(PROFILE_PARSE_1);
 }
 
 void UART_Parse_2(UART_DMA_QueueStruct * msg) // VCP
 {
 	char str[] = "UART2_RX Received from Docklight > PARSE > Out to UART1_TX >  Wired to UART3_RX";
+	UART_DMA_RxFrame *frames[UART_DMA_QUEUE_SIZE];
+	uint32_t count;
+	uint32_t i;
+
+	PROFILE_START(PROFILE_PARSE_2);
 
-	if(UART_DMA_MsgRdy(msg))
+	count = UART_DMA_RxAcquireAll(msg, frames, UART_DMA_QUEUE_SIZE);
+	for(i = 0; i < count; i++)
 	{
+		if(frames[i]->size >= 5 && strncmp((char*)frames[i]->data, "STATS", 5) == 0)
+		{
+			UART_SendStats();
+			continue;
+		}
+		if(frames[i]->size >= 7 && strncmp((char*)frames[i]->data, "PROFILE", 7) == 0)
+		{
+			DWT_Profile_Dump(&uart2);
+			continue;
+		}
 		UART_DMA_NotifyUser(&uart2, str, strlen(str), true);
-		UART_DMA_NotifyUser(&uart1, (char*)msg->rx.msgToParse->data, msg->rx.msgToParse->size, false);
+		UART_DMA_NotifyUser(&uart1, (char*)frames[i]->data, frames[i]->size, false);
 	}
+	UART_DMA_RxRelease(msg, count);
+
+	PROFILE_END(PROFILE_PARSE_2);
 }
 
 void UART_Parse_3(UART_DMA_QueueStruct * msg)
 {
 	char str[] = "UART3_RX Received from UART1_TX > PARSE > Out UART3_TX > Wired to UART1_RX";
+	UART_DMA_RxFrame *frames[UART_DMA_QUEUE_SIZE];
+	uint32_t count;
+	uint32_t i;
 
-	if(UART_DMA_MsgRdy(msg))
+	PROFILE_START(PROFILE_PARSE_3);
+
+	count = UART_DMA_RxAcquireAll(msg, frames, UART_DMA_QUEUE_SIZE);
+	for(i = 0; i < count; i++)
 	{
+		if(UART_DMA_BaudCommand(msg, frames[i]))
+		{
+			continue;
+		}
 		UART_DMA_NotifyUser(&uart2, str, strlen(str), true);
-		UART_DMA_NotifyUser(&uart3, (char*)msg->rx.msgToParse->data, msg->rx.msgToParse->size, false);
+		UART_DMA_NotifyUser(&uart3, (char*)frames[i]->data, frames[i]->size, false);
 	}
+	UART_DMA_RxRelease(msg, count);
+
+	PROFILE_END(PROFILE_PARSE_3);
 }
 
-/*
- * Description: Increment pointer and enable interrupt again.
- *
- */
-void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+void UART_Parse_4(UART_DMA_QueueStruct * msg)
 {
-	if(huart == uart1.huart)
-	{
-		uart1.rx.queue[uart1.rx.ptr.index_IN].size = Size;
-		RingBuff_Ptr_Input(&uart1.rx.ptr, UART_DMA_QUEUE_SIZE);
-		UART_DMA_EnableRxInterrupt(&uart1);
-	}
-	else if(huart == uart2.huart)
+	char str[] = "UART4_RX Received > PARSE > Out to UART2_TX > Docklight";
+	UART_DMA_RxFrame *frames[UART_DMA_QUEUE_SIZE];
+	uint32_t count;
+	uint32_t i;
+
+	PROFILE_START(PROFILE_PARSE_4);
+
+	count = UART_DMA_RxAcquireAll(msg, frames, UART_DMA_QUEUE_SIZE);
+	for(i = 0; i < count; i++)
 	{
-		uart2.rx.queue[uart2.rx.ptr.index_IN].size = Size;
-		RingBuff_Ptr_Input(&uart2.rx.ptr, UART_DMA_QUEUE_SIZE);
-		UART_DMA_EnableRxInterrupt(&uart2);
+		UART_DMA_NotifyUser(&uart2, str, strlen(str), true);
+		UART_DMA_NotifyUser(&uart2, (char*)frames[i]->data, frames[i]->size, false);
 	}
-	else if(huart == uart3.huart)
+	UART_DMA_RxRelease(msg, count);
+
+	PROFILE_END(PROFILE_PARSE_4);
+}
+
+void UART_Parse_LP1(UART_DMA_QueueStruct * msg)
+{
+	char str[] = "LPUART1_RX Received > PARSE > Out to UART2_TX > Docklight";
+	UART_DMA_RxFrame *frames[UART_DMA_QUEUE_SIZE];
+	uint32_t count;
+	uint32_t i;
+
+	PROFILE_START(PROFILE_PARSE_LP1);
+
+	count = UART_DMA_RxAcquireAll(msg, frames, UART_DMA_QUEUE_SIZE);
+	for(i = 0; i < count; i++)
 	{
-		uart3.rx.queue[uart3.rx.ptr.index_IN].size = Size;
-		RingBuff_Ptr_Input(&uart3.rx.ptr, UART_DMA_QUEUE_SIZE);
-		UART_DMA_EnableRxInterrupt(&uart3);
+		UART_DMA_NotifyUser(&uart2, str, strlen(str), true);
+		UART_DMA_NotifyUser(&uart2, (char*)frames[i]->data, frames[i]->size, false);
 	}
+	UART_DMA_RxRelease(msg, count);
+
+	PROFILE_END(PROFILE_PARSE_LP1);
 }
 
 /*
- * Description: The HAL driver calls this callback when it finishes transmitting.
- * 				We clear the txPending flag and call UART_DMA_SendMessage again.
+ * Description: Send a binary UART_DMA_StatsPacket for each port to UART2. Port id is 1-4 for USART1-UART4 and 5 for LPUART1.
+ *
  */
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+void UART_SendStats(void)
 {
-	if(huart == uart1.huart)
-	{
-		uart1.tx.txPending = false;
-		UART_DMA_SendMessage(&uart1);
-	}
-	else if(huart == uart2.huart)
-	{
-		uart2.tx.txPending = false;
-		UART_DMA_SendMessage(&uart2);
-	}
-	else if(huart == uart3.huart)
-	{
-		uart3.tx.txPending = false;
-		UART_DMA_SendMessage(&uart3);
-	}
+	UART_DMA_StatsSend(&uart2, &uart1, 1);
+	UART_DMA_StatsSend(&uart2, &uart2, 2);
+	UART_DMA_StatsSend(&uart2, &uart3, 3);
+	UART_DMA_StatsSend(&uart2, &uart4, 4);
+	UART_DMA_StatsSend(&uart2, &lpuart1, 5);
 }
 
 void BlinkGreenLED(void)
@@ -46,3 +46,59 @@ void RingBuff_Ptr_Output(RING_BUFF_STRUCT *ptr, uint32_t bufferSize) {
 		ptr->cnt_Handle--;
 	}
 }
+
+/*
+ * Description: Single producer/single consumer ring buffer.
+ * 				The producer fills the element at RingBuff_SPSC_IndexIn then calls RingBuff_SPSC_Input.
+ * 				The consumer reads the element at RingBuff_SPSC_IndexOut while RingBuff_SPSC_Count is not zero,
+ * 				then calls RingBuff_SPSC_Output.
+ * 				The full buffer size can be used. When full, the input is rejected instead of overwriting the oldest.
+ *
+ */
+void RingBuff_SPSC_Reset(RING_BUFF_SPSC_STRUCT *ptr) {
+	ptr->head = 0;
+	ptr->tail = 0;
+	ptr->cnt_OverFlow = 0;
+}
+
+uint32_t RingBuff_SPSC_IndexIn(RING_BUFF_SPSC_STRUCT *ptr, uint32_t bufferSize) {
+	return ptr->head & (bufferSize - 1);
+}
+
+uint32_t RingBuff_SPSC_IndexOut(RING_BUFF_SPSC_STRUCT *ptr, uint32_t bufferSize) {
+	return ptr->tail & (bufferSize - 1);
+}
+
+uint32_t RingBuff_SPSC_Count(RING_BUFF_SPSC_STRUCT *ptr) {
+	uint32_t count = ptr->head - ptr->tail;
+
+	__DMB(); // element must not be read before head
+	return count;
+}
+
+/*
+ * Description: Producer only. Returns 0 if the element was added, -1 if the buffer was full.
+ */
+int RingBuff_SPSC_Input(RING_BUFF_SPSC_STRUCT *ptr, uint32_t bufferSize) {
+	if ((ptr->head - ptr->tail) >= bufferSize) {
+		ptr->cnt_OverFlow++;
+		return -1;
+	}
+
+	__DMB(); // element must be written before head is moved
+	ptr->head++;
+	return 0;
+}
+
+/*
+ * Description: Consumer only. Returns 0 if an element was removed, -1 if the buffer was empty.
+ */
+int RingBuff_SPSC_Output(RING_BUFF_SPSC_STRUCT *ptr) {
+	if (ptr->head == ptr->tail) {
+		return -1;
+	}
+
+	__DMB(); // element must be done being read before tail is moved
+	ptr->tail++;
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * UART_Benchmark.c
+ *
+ *  Created on: Oct 16, 2026
+ *      Author: agent
+ *
+ *      Keeps the tx ring of every added port full and counts the bytes received back,
+ *      so all ports run full duplex at the same time. Wire each TX to a RX (i.e. loop back, or USART1 <> USART3).
+ *
+ *      The first interval runs without traffic to count how many polling loops run when idle.
+ *      CPU headroom is the polling loops during traffic as a percentage of that.
+ *
+ */
+
+#include "main.h"
+#include "UART_Benchmark.h"
+
+
+static uint8_t benchmarkPattern[UART_BENCHMARK_CHUNK_SIZE];
+
+static void UART_BenchmarkReport(UART_BenchmarkStruct *bench, uint32_t elapsed);
+
+
+/*
+ * Description: Initialize benchmark. report is the port the results are sent to.
+ *
+ */
+void UART_BenchmarkInit(UART_BenchmarkStruct *bench, UART_DMA_QueueStruct *report)
+{
+	uint32_t i;
+
+	memset(bench, 0, sizeof(UART_BenchmarkStruct));
+	bench->report = report;
+	bench->startTick = HAL_GetTick();
+
+	for(i = 0; i < UART_BENCHMARK_CHUNK_SIZE; i++)
+	{
+		benchmarkPattern[i] = 'A' + (i % 26);
+	}
+}
+
+/*
+ * Description: Add a port to drive. Returns -1 if UART_BENCHMARK_PORTS_MAX is reached.
+ *
+ */
+int UART_BenchmarkAddPort(UART_BenchmarkStruct *bench, UART_DMA_QueueStruct *port)
+{
+	if(bench->portCount >= UART_BENCHMARK_PORTS_MAX)
+	{
+		return -1;
+	}
+
+	bench->port[bench->portCount++] = port;
+
+	return 0;
+}
+
+/*
+ * Description: Call from polling routine instead of the parsers.
+ *
+ */
+void UART_BenchmarkRun(UART_BenchmarkStruct *bench)
+{
+	UART_DMA_RxFrame *frames[UART_DMA_QUEUE_SIZE];
+	UART_DMA_QueueStruct *port;
+	uint32_t elapsed = HAL_GetTick() - bench->startTick;
+	uint32_t reserve;
+	uint32_t count;
+	uint32_t i;
+	uint32_t j;
+
+	bench->loops++;
+
+	if(!bench->calibrated)
+	{
+		if(elapsed >= UART_BENCHMARK_INTERVAL)
+		{
+			bench->idleLoops = (uint32_t)(((uint64_t)bench->loops * UART_BENCHMARK_INTERVAL) / elapsed);
+			bench->loops = 0;
+			bench->startTick = HAL_GetTick();
+			bench->calibrated = true;
+		}
+		return;
+	}
+
+	for(i = 0; i < bench->portCount; i++)
+	{
+		port = bench->port[i];
+
+		// keep the tx ring full
+		reserve = (port == bench->report) ? UART_BENCHMARK_REPORT_RESERVE : 0;
+		while(UART_DMA_TX_GetFreeBytes(port) >= UART_BENCHMARK_CHUNK_SIZE + 16 + reserve // 16 for header and pad
+				&& UART_DMA_TX_GetMaxMessageSize(port) >= UART_BENCHMARK_CHUNK_SIZE)
+		{
+			if(UART_DMA_TX_AddMessageToBuffer(port, benchmarkPattern, UART_BENCHMARK_CHUNK_SIZE) != 0)
+			{
+				break;
+			}
+			bench->txBytes[i] += UART_BENCHMARK_CHUNK_SIZE;
+		}
+		UART_DMA_SendMessage(port);
+
+		// count and drop what was received
+		count = UART_DMA_RxAcquireAll(port, frames, UART_DMA_QUEUE_SIZE);
+		for(j = 0; j < count; j++)
+		{
+			bench->rxBytes[i] += frames[j]->size;
+		}
+		UART_DMA_RxRelease(port, count);
+	}
+
+	if(elapsed >= UART_BENCHMARK_INTERVAL)
+	{
+		UART_BenchmarkReport(bench, elapsed);
+
+		bench->loops = 0;
+		bench->startTick = HAL_GetTick();
+		memset(bench->txBytes, 0, sizeof(bench->txBytes));
+		memset(bench->rxBytes, 0, sizeof(bench->rxBytes));
+	}
+}
+
+/*
+ * Description: Send bytes per second for each port, the total and the CPU headroom to the report port.
+ *
+ */
+static void UART_BenchmarkReport(UART_BenchmarkStruct *bench, uint32_t elapsed)
+{
+	uint32_t txTotal = 0;
+	uint32_t rxTotal = 0;
+	uint32_t txRate;
+	uint32_t rxRate;
+	uint32_t headroom = 0;
+	uint32_t i;
+
+	for(i = 0; i < bench->portCount; i++)
+	{
+		txRate = (uint32_t)(((uint64_t)bench->txBytes[i] * 1000) / elapsed);
+		rxRate = (uint32_t)(((uint64_t)bench->rxBytes[i] * 1000) / elapsed);
+		txTotal += txRate;
+		rxTotal += rxRate;
+
+		UART_DMA_Printf(bench->report, "port %u tx %u B/s rx %u B/s\r\n", i, txRate, rxRate);
+	}
+
+	if(bench->idleLoops)
+	{
+		headroom = (uint32_t)(((uint64_t)bench->loops * UART_BENCHMARK_INTERVAL * 100) / ((uint64_t)elapsed * bench->idleLoops));
+	}
+
+	UART_DMA_Printf(bench->report, "total tx %u B/s rx %u B/s, cpu headroom %u%%\r\n", txTotal, rxTotal, headroom);
+}
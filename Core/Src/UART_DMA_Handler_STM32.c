@@ -10,107 +10,2604 @@
 
 #include "main.h"
 #include "UART_DMA_Handler_STM32.h"
+#include <stdarg.h>
 
 
+#if (UART_DMA_QUEUE_SIZE & (UART_DMA_QUEUE_SIZE - 1)) != 0 || UART_DMA_QUEUE_SIZE < (UART_DMA_RX_SMALL_COUNT + UART_DMA_RX_LARGE_COUNT)
+#error "UART_DMA_QUEUE_SIZE must be a power of 2 and hold a frame for every rx slot"
+#endif
+
+#if UART_DMA_RX_LARGE_COUNT < 3
+#error "UART_DMA_RX_LARGE_COUNT must be 3 or more, so in normal mode a slot can be armed while two are waiting to be parsed or bridged"
+#endif
+
+#if UART_DMA_RTS_OFF_FREE_SLOTS >= UART_DMA_RTS_ON_FREE_SLOTS || UART_DMA_RTS_ON_FREE_SLOTS > (UART_DMA_RX_SMALL_COUNT + UART_DMA_RX_LARGE_COUNT)
+#error "UART_DMA_RTS_ON_FREE_SLOTS must be more than UART_DMA_RTS_OFF_FREE_SLOTS and no more than the number of rx slots"
+#endif
+
+#if UART_DMA_TX_PRIORITIES < 2 || UART_DMA_TX_NORMAL_RING_SIZE <= 0
+#error "UART_DMA_TX_PRIORITIES must be 2 or more and the urgent rings must leave room in UART_DMA_TX_RING_SIZE for the normal ring"
+#endif
+
+#if (UART_DMA_TX_NORMAL_RING_SIZE & (UART_DMA_TX_NORMAL_RING_SIZE - 1)) != 0 || (UART_DMA_TX_URGENT_RING_SIZE & (UART_DMA_TX_URGENT_RING_SIZE - 1)) != 0
+#error "UART_DMA_TX_URGENT_RING_SIZE and what it leaves of UART_DMA_TX_RING_SIZE for the normal ring must be powers of 2"
+#endif
+
+_Static_assert(sizeof(UART_DMA_QueueStruct) <= UART_DMA_PORT_RAM_MAX, "UART_DMA_QueueStruct is larger than UART_DMA_PORT_RAM_MAX, reduce the buffer sizes");
+
+#if UART_DMA_TX_MAILBOX_SIZE > UART_DMA_TX_COALESCE_SIZE
+#error "UART_DMA_TX_MAILBOX_SIZE must fit in coalesceBuffer, mailbox values are sent from there"
+#endif
+
+// Peripherals are on 1KB boundaries. The address bits above that give every U(S)ART on the G4 its own table index.
+#define UART_DMA_PORT_TABLE_SIZE 32
+#define UART_DMA_PORT_INDEX(instance) ((((uint32_t)(instance)) >> 10) & (UART_DMA_PORT_TABLE_SIZE - 1))
+
+#define UART_DMA_TX_ALIGN(x) (((x) + 3UL) & ~3UL)
+
+#define UART_DMA_TX_FLAG_PAD 0x0001 // unused space at the end of the ring, the next message is at index 0
+#define UART_DMA_TX_FLAG_BUFFER 0x0002 // data is a UART_DMA_TxBufferRef
+#define UART_DMA_TX_FLAG_CONTINUED 0x0004 // not the first fragment of the message, it is sent or dropped with the first one
+
+typedef struct
+{
+	uint16_t size; // message size
+	uint16_t flags;
+	uint32_t queuedTick; // HAL_GetTick when the message was added, for the tx latency
+	uint32_t timeToLive; // ms after queuedTick that the message is dropped instead of sent. 0 = never
+}UART_DMA_TxHeader; // stored in front of each message in the tx ring. A pad only uses size and flags
+
+typedef struct
+{
+	UART_DMA_TxBuffer *buffer;
+	uint32_t offset; // start of this transfer in buffer->data
+}UART_DMA_TxBufferRef; // stored in the tx ring for a zero copy buffer, one per transfer
+
+static void UART_DMA_RxStoreFrame(UART_DMA_QueueStruct *msg, uint32_t index, uint32_t size, bool more);
+static void UART_DMA_RxCutThroughPoll(UART_DMA_QueueStruct *msg);
+static int UART_DMA_RxAllocSlot(UART_DMA_QueueStruct *msg, uint8_t sizeClass);
+static int UART_DMA_RxNoSlot(UART_DMA_QueueStruct *msg, uint8_t sizeClass);
+static void UART_DMA_RxUpdateRts(UART_DMA_QueueStruct *msg);
+static void UART_DMA_RxQueueFrame(UART_DMA_QueueStruct *msg, uint8_t sizeClass, uint8_t slot, uint32_t size, bool more);
+static void UART_DMA_RxBridgeFrame(UART_DMA_QueueStruct *msg, uint8_t sizeClass, uint8_t slot, uint32_t size);
+static void UART_DMA_RxBridgeRelease(UART_DMA_TxBuffer *buffer);
+static uint32_t UART_DMA_TX_FreeBytes(UART_DMA_TxQueue *queue);
+static uint32_t UART_DMA_TX_MaxMessageSize(UART_DMA_TxQueue *queue);
+static uint8_t * UART_DMA_TX_Reserve(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, uint32_t size);
+static void UART_DMA_TX_Commit(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, uint32_t size, uint16_t flags, uint32_t timeToLive);
+static bool UART_DMA_TX_IsExpired(UART_DMA_TxHeader *header, uint32_t tick);
+static void UART_DMA_TX_Drop(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, UART_DMA_TxHeader *header);
+static UART_DMA_TxHeader * UART_DMA_TX_NextMessage(UART_DMA_QueueStruct *msg, uint32_t *priority);
+static uint32_t UART_DMA_TX_Coalesce(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, uint32_t priority, uint32_t *length, uint32_t *count);
+static void UART_DMA_TX_RecordLatency(UART_DMA_QueueStruct *msg, uint32_t priority, UART_DMA_TxHeader *header);
+static int UART_DMA_TX_StartMailbox(UART_DMA_QueueStruct *msg);
+static int UART_DMA_TX_AddSegments(UART_DMA_QueueStruct *msg, uint32_t priority, uint32_t timeToLive, const UART_DMA_TxSegment *segments, uint32_t count);
+static void UART_DMA_TX_Start(UART_DMA_QueueStruct * msg);
+static uint32_t UART_DMA_Format(char *buf, uint32_t size, const char *format, va_list args);
+static uint32_t UART_DMA_GetKernelClock(UART_HandleTypeDef *huart);
+static int UART_DMA_CheckBaudRate(UART_HandleTypeDef *huart, uint32_t baudRate, UART_DMA_BaudConfig *config);
+static void UART_DMA_ApplyBaudRate(UART_DMA_QueueStruct *msg);
+static int UART_DMA_AutoBaudArm(UART_DMA_QueueStruct *msg);
+static void UART_DMA_AutoBaudPoll(UART_DMA_QueueStruct *msg);
+static void UART_DMA_AutoBaudISR(UART_HandleTypeDef *huart);
+static void UART_DMA_StatsUpdate(UART_DMA_QueueStruct *msg);
+
+static UART_DMA_QueueStruct *uartDMA_Port[UART_DMA_PORT_TABLE_SIZE]; // registered ports, indexed by UART_DMA_PORT_INDEX
+static uint32_t uartDMA_RegisteredPorts; // bit UART_DMA_PORT_INDEX is set for each registered port
+static volatile uint32_t uartDMA_RxReadyPorts; // bit UART_DMA_PORT_INDEX is set when the port has frames to parse
+static volatile uint32_t uartDMA_TxReadyPorts; // bit UART_DMA_PORT_INDEX is set when a transfer completed and tx.callback is set
+
+static UART_DMA_TxBuffer txBufferPool[UART_DMA_TX_BUFFER_POOL_SIZE];
+static uint8_t txBufferPoolData[UART_DMA_TX_BUFFER_POOL_SIZE][UART_DMA_TX_BUFFER_SIZE];
+
+/*
+ * Description: assign uart instance to data structure, if variable was not assigned during instantiation, and register it.
+ * 	example: UART_DMA_Init(&uartDMA_RXMsg, &huart2);
+ *
+ */
+int UART_DMA_Init(UART_DMA_QueueStruct *msg, UART_HandleTypeDef *huart)
+{
+	msg->huart = huart;
+
+	return UART_DMA_Register(msg);
+}
+
+/*
+ * Description: Register the data structure so the HAL callbacks in this file can find it from the huart in constant time.
+ * 				Returns 0 on success, -1 if another port already uses the same table index.
+ *
+ */
+int UART_DMA_Register(UART_DMA_QueueStruct *msg)
+{
+	uint32_t index = UART_DMA_PORT_INDEX(msg->huart->Instance);
+	uint32_t i;
+
+	if(uartDMA_Port[index] != NULL && uartDMA_Port[index] != msg)
+	{
+		return -1;
+	}
+
+	uartDMA_Port[index] = msg;
+	uartDMA_RegisteredPorts |= 1UL << index;
+
+	msg->tx.queue[UART_DMA_TX_PRIORITY_NORMAL].ring = msg->tx.normalRing;
+	msg->tx.queue[UART_DMA_TX_PRIORITY_NORMAL].size = UART_DMA_TX_NORMAL_RING_SIZE;
+	for(i = 1; i < UART_DMA_TX_PRIORITIES; i++)
+	{
+		msg->tx.queue[i].ring = msg->tx.urgentRing[i - 1];
+		msg->tx.queue[i].size = UART_DMA_TX_URGENT_RING_SIZE;
+	}
+
+	return 0;
+}
+
+/*
+ * Description: Return the registered data structure for huart, or NULL.
+ *
+ */
+UART_DMA_QueueStruct * UART_DMA_GetPort(UART_HandleTypeDef *huart)
+{
+	UART_DMA_QueueStruct *msg = uartDMA_Port[UART_DMA_PORT_INDEX(huart->Instance)];
+
+	if(msg != NULL && msg->huart == huart)
+	{
+		return msg;
+	}
+
+	return NULL;
+}
+
+/*
+ * Description: Return the bit of this port in the UART_DMA_Dispatch masks
+ *
+ */
+uint32_t UART_DMA_PortMask(UART_DMA_QueueStruct *msg)
+{
+	return 1UL << UART_DMA_PORT_INDEX(msg->huart->Instance);
+}
+
+/*
+ * Description: Call from polling routine
+ * 				Call rx.callback of each port with frames ready, then check its rx in case it ran out of slots,
+ * 				and tx.callback of each port that completed a transfer. Ports are found with count leading zeros
+ * 				on the ready bits, so a port with nothing to do costs nothing.
+ *
+ */
+void UART_DMA_Dispatch(void)
+{
+	UART_DMA_QueueStruct *msg;
+	uint32_t primask = __get_PRIMASK();
+	uint32_t rxReady;
+	uint32_t txReady;
+	uint32_t index;
+
+	__disable_irq();
+	rxReady = uartDMA_RxReadyPorts;
+	txReady = uartDMA_TxReadyPorts;
+	uartDMA_RxReadyPorts = 0;
+	uartDMA_TxReadyPorts = 0;
+	__set_PRIMASK(primask);
+
+	while(rxReady)
+	{
+		index = 31 - __CLZ(rxReady);
+		rxReady &= ~(1UL << index);
+
+		msg = uartDMA_Port[index];
+		if(msg->rx.callback)
+		{
+			msg->rx.callback(msg);
+		}
+		UART_DMA_CheckRxInterruptErrorFlag(msg);
+	}
+
+	while(txReady)
+	{
+		index = 31 - __CLZ(txReady);
+		txReady &= ~(1UL << index);
+
+		msg = uartDMA_Port[index];
+		msg->tx.callback(msg);
+	}
+}
+
+/*
+ * Description: Call UART_DMA_CheckRxInterruptErrorFlag for every registered port.
+ * 				Call from polling routine once per SysTick for the work that isn't started by an interrupt,
+ * 				rx retries, cut through threshold, auto baud and the stats sample.
+ *
+ */
+void UART_DMA_CheckAllPorts(void)
+{
+	uint32_t ports = uartDMA_RegisteredPorts;
+	uint32_t index;
+
+	while(ports)
+	{
+		index = 31 - __CLZ(ports);
+		ports &= ~(1UL << index);
+
+		UART_DMA_CheckRxInterruptErrorFlag(uartDMA_Port[index]);
+	}
+}
+
+/*
+ * Description: Sleep until the next interrupt if no port is ready. Call at the end of the polling routine.
+ * 				Interrupts are disabled around the check so a frame queued right after it still wakes the core,
+ * 				WFI wakes on a pending interrupt even with interrupts disabled. The DMA keeps running while asleep.
+ * 				SysTick wakes the core every 1 ms for the timers.
+ *
+ */
+void UART_DMA_Sleep(void)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if(uartDMA_RxReadyPorts == 0 && uartDMA_TxReadyPorts == 0)
+	{
+		__DSB();
+		__WFI();
+	}
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Description: Enable rx interrupt
+ * 				Normal mode, the DMA receives into a free large slot. If there isn't one, hal_status is set to HAL_BUSY
+ * 				and UART_DMA_CheckRxInterruptErrorFlag will try again.
+ * 				In circular mode the DMA channel is switched to DMA_CIRCULAR and is started once on circBuffer.
+ * 				The DMA then keeps running and doesn't need to be enabled again after each idle event.
+ *
+ */
+void UART_DMA_EnableRxInterrupt(UART_DMA_QueueStruct *msg)
+{
+	int slot;
+
+	UART_DMA_RxUpdateRts(msg);
+
+	if(msg->rx.circularMode)
+	{
+		if(msg->huart->hdmarx->Init.Mode != DMA_CIRCULAR)
+		{
+			msg->huart->hdmarx->Init.Mode = DMA_CIRCULAR;
+			if(HAL_DMA_Init(msg->huart->hdmarx) != HAL_OK)
+			{
+				msg->rx.hal_status = HAL_ERROR;
+				return;
+			}
+		}
+
+		msg->rx.circIndex = 0; // DMA starts over at the beginning of circBuffer
+		msg->rx.hal_status = HAL_UARTEx_ReceiveToIdle_DMA(msg->huart, msg->rx.circBuffer, UART_DMA_RX_CIRC_SIZE);
+		return;
+	}
+
+	if(!msg->rx.armed)
+	{
+		slot = UART_DMA_RxAllocSlot(msg, UART_DMA_RX_LARGE);
+		if(slot < 0)
+		{
+			slot = UART_DMA_RxNoSlot(msg, UART_DMA_RX_LARGE);
+		}
+		if(slot < 0)
+		{
+			msg->rx.hal_status = HAL_BUSY; // all large slots are waiting to be parsed
+			return;
+		}
+		msg->rx.armedSlot = slot;
+		msg->rx.armed = true;
+	}
+
+	msg->rx.hal_status = HAL_UARTEx_ReceiveToIdle_DMA(msg->huart, msg->rx.large[msg->rx.armedSlot], UART_DMA_RX_LARGE_SIZE);
+}
+
+/*
+ * Description: Call from polling routine
+ *
+ */
+void UART_DMA_CheckRxInterruptErrorFlag(UART_DMA_QueueStruct *msg)
+{
+	UART_DMA_StatsUpdate(msg);
+
+	if(msg->tx.baudReady)
+	{
+		UART_DMA_ApplyBaudRate(msg);
+	}
+
+	if(msg->rx.autoBaud)
+	{
+		UART_DMA_AutoBaudPoll(msg);
+		return;
+	}
+
+	if(msg->rx.hal_status != HAL_OK)
+	{
+		msg->stats.rxBusyRetries++;
+		msg->rx.hal_status = HAL_OK;
+		UART_DMA_EnableRxInterrupt(msg);
+	}
+
+	UART_DMA_RxCutThroughPoll(msg);
+}
+
+/*
+ * Description: The DMA has no interrupt at an arbitrary byte count, so the DMA counter is read here to find out
+ * 				if cutThroughSize bytes are waiting. Interrupts are disabled so the rx event can't queue at the same time.
+ *
+ */
+static void UART_DMA_RxCutThroughPoll(UART_DMA_QueueStruct *msg)
+{
+	uint32_t primask;
+	uint32_t position;
+	uint32_t pending;
+
+	if(!msg->rx.circularMode || msg->rx.cutThroughSize == 0 || msg->rx.hal_status != HAL_OK)
+	{
+		return;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	position = UART_DMA_RX_CIRC_SIZE - __HAL_DMA_GET_COUNTER(msg->huart->hdmarx);
+	if(position >= UART_DMA_RX_CIRC_SIZE)
+	{
+		position = 0;
+	}
+
+	pending = (position + UART_DMA_RX_CIRC_SIZE - msg->rx.circIndex) % UART_DMA_RX_CIRC_SIZE;
+	if(pending >= msg->rx.cutThroughSize)
+	{
+		UART_DMA_RxStoreFrame(msg, msg->rx.circIndex, pending, true);
+		msg->rx.circIndex = position;
+	}
+
+	__set_PRIMASK(primask);
+}
+
+
+/*
+ * Description: Call from HAL_UARTEx_RxEventCallback.
+ * 				Normal mode, size is the frame length in the armed large slot. A short frame is moved to a small slot
+ * 				so the large slot can be used again, otherwise the large slot is queued and a new one is armed.
+ * 				If the port is bridged the large slot is always sent as is, without the copy.
+ * 				A frame that filled the slot (transfer complete, not idle) is queued with more set.
+ * 				Circular mode, size is the DMA write position in circBuffer. This is called on half transfer, transfer complete and idle.
+ * 				On idle, the bytes since the last frame are copied to a slot sized for the frame.
+ * 				On half transfer, the bytes are only copied if half of circBuffer is waiting, so a long frame is split
+ * 				before the DMA can overwrite it. On transfer complete they are always copied. The HAL gives no idle event
+ * 				once the DMA counter has reloaded, so a frame that ends at the end of circBuffer is only seen here.
+ * 				It is queued with more set, as the frame may still continue at the start of circBuffer.
+ * 				With cutThroughSize set, the bytes are copied on every half transfer and transfer complete,
+ * 				and when cutThroughSize bytes are waiting, so a long frame can be forwarded while it is still arriving.
+ * 				Frames queued before idle have more set.
+ *
+ */
+void UART_DMA_RxEvent(UART_DMA_QueueStruct *msg, uint16_t size)
+{
+	uint32_t eventType = HAL_UARTEx_GetRxEventType(msg->huart);
+	uint32_t position;
+	uint32_t pending;
+	bool more;
+	int slot;
+
+	if(!msg->rx.circularMode)
+	{
+		if(eventType == HAL_UART_RXEVENT_HT)
+		{
+			return; // DMA is still receiving into the slot
+		}
+
+		more = (eventType != HAL_UART_RXEVENT_IDLE); // transfer complete, the slot is full and the frame continues in the next one
+
+		if(msg->rx.bridge == NULL && size <= UART_DMA_RX_SMALL_SIZE && (slot = UART_DMA_RxAllocSlot(msg, UART_DMA_RX_SMALL)) >= 0)
+		{
+			memcpy(msg->rx.small[slot], msg->rx.large[msg->rx.armedSlot], size);
+			UART_DMA_RxQueueFrame(msg, UART_DMA_RX_SMALL, slot, size, more);
+		}
+		else
+		{
+			UART_DMA_RxQueueFrame(msg, UART_DMA_RX_LARGE, msg->rx.armedSlot, size, more);
+			msg->rx.armed = false;
+		}
+		UART_DMA_EnableRxInterrupt(msg);
+		return;
+	}
+
+	position = size;
+	if(position >= UART_DMA_RX_CIRC_SIZE)
+	{
+		position = 0;
+	}
+
+	pending = (position + UART_DMA_RX_CIRC_SIZE - msg->rx.circIndex) % UART_DMA_RX_CIRC_SIZE;
+	if(pending == 0)
+	{
+		return;
+	}
+
+	if(eventType != HAL_UART_RXEVENT_HT || pending >= UART_DMA_RX_CIRC_SIZE / 2
+			|| (msg->rx.cutThroughSize && (eventType != HAL_UART_RXEVENT_IDLE || pending >= msg->rx.cutThroughSize)))
+	{
+		UART_DMA_RxStoreFrame(msg, msg->rx.circIndex, pending, eventType != HAL_UART_RXEVENT_IDLE);
+		msg->rx.circIndex = position;
+	}
+}
+
+/*
+ * Description: Copy size bytes from circBuffer starting at index into a small or large slot and queue it.
+ * 				A frame longer than UART_DMA_RX_LARGE_SIZE is split across large slots.
+ * 				If no slot is free the rest of the frame is dropped.
+ * 				more is set on the last part if the frame isn't complete yet. The other parts always have more set.
+ *
+ */
+static void UART_DMA_RxStoreFrame(UART_DMA_QueueStruct *msg, uint32_t index, uint32_t size, bool more)
+{
+	uint8_t sizeClass;
+	uint8_t *ptr;
+	uint32_t length;
+	uint32_t i;
+	int slot;
+
+	while(size)
+	{
+		length = (size > UART_DMA_RX_LARGE_SIZE) ? UART_DMA_RX_LARGE_SIZE : size;
+
+		sizeClass = UART_DMA_RX_LARGE;
+		slot = -1;
+		if(length <= UART_DMA_RX_SMALL_SIZE)
+		{
+			sizeClass = UART_DMA_RX_SMALL;
+			slot = UART_DMA_RxAllocSlot(msg, UART_DMA_RX_SMALL);
+			if(slot < 0)
+			{
+				sizeClass = UART_DMA_RX_LARGE; // no small slot left, use a large one
+			}
+		}
+		if(slot < 0)
+		{
+			slot = UART_DMA_RxAllocSlot(msg, UART_DMA_RX_LARGE);
+			if(slot < 0)
+			{
+				sizeClass = UART_DMA_RX_LARGE;
+				slot = UART_DMA_RxNoSlot(msg, UART_DMA_RX_LARGE);
+			}
+			if(slot < 0)
+			{
+				msg->rx.overflow++;
+				return;
+			}
+		}
+
+		ptr = (sizeClass == UART_DMA_RX_SMALL) ? msg->rx.small[slot] : msg->rx.large[slot];
+		for(i = 0; i < length; i++)
+		{
+			ptr[i] = msg->rx.circBuffer[index];
+			if(++index >= UART_DMA_RX_CIRC_SIZE)
+			{
+				index = 0;
+			}
+		}
+
+		size -= length;
+		UART_DMA_RxQueueFrame(msg, sizeClass, slot, length, (size != 0) || more);
+	}
+}
+
+/*
+ * Description: Find a free slot of sizeClass and mark it used. Returns the slot or -1 if all are used.
+ * 				This is called from interrupt. The slot is only freed by UART_DMA_RxRelease, so no shared counter is needed.
+ * 				Slots, not the queue, limit how many frames are waiting, so the rx queue never has to drop one.
+ *
+ */
+static int UART_DMA_RxAllocSlot(UART_DMA_QueueStruct *msg, uint8_t sizeClass)
+{
+	bool *used = (sizeClass == UART_DMA_RX_SMALL) ? msg->rx.smallUsed : msg->rx.largeUsed;
+	uint32_t *highWater = (sizeClass == UART_DMA_RX_SMALL) ? &msg->rx.smallHighWater : &msg->rx.largeHighWater;
+	uint32_t count = (sizeClass == UART_DMA_RX_SMALL) ? UART_DMA_RX_SMALL_COUNT : UART_DMA_RX_LARGE_COUNT;
+	uint32_t inUse = 1;
+	int slot = -1;
+	uint32_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(used[i])
+		{
+			inUse++;
+		}
+		else if(slot < 0)
+		{
+			slot = i;
+		}
+	}
+
+	if(slot >= 0)
+	{
+		used[slot] = true;
+		if(inUse > *highWater)
+		{
+			*highWater = inUse;
+		}
+		UART_DMA_RxUpdateRts(msg);
+	}
+
+	return slot;
+}
+
+/*
+ * Description: Called when no slot of sizeClass is free for a new frame. What happens depends on rx.policy.
+ * 				UART_DMA_RX_DROP_NEWEST, -1 is returned and the new frame is dropped.
+ * 				UART_DMA_RX_DROP_OLDEST, frames are dropped from the front of the rx queue up to and including the oldest
+ * 				one of sizeClass, and its slot is returned for the new frame. The frames left stay in order, and if the
+ * 				dropped frame has more set, the parts after it are dropped too. While the parser holds acquired frames,
+ * 				or no frame of sizeClass is queued, the new frame is dropped instead.
+ * 				UART_DMA_RX_REJECT, the new frame is dropped, counted in rx.rejected, and RTS is deasserted right away
+ * 				so the other end stops until UART_DMA_RTS_ON_FREE_SLOTS are free again. Use with rx.rtsPort.
+ *
+ */
+static int UART_DMA_RxNoSlot(UART_DMA_QueueStruct *msg, uint8_t sizeClass)
+{
+	UART_DMA_RxFrame *frame;
+	uint32_t primask;
+	uint32_t index;
+	bool more = false;
+	int slot = -1;
+
+	if(msg->rx.policy == UART_DMA_RX_REJECT)
+	{
+		msg->rx.rejected++;
+		if(msg->rx.rtsPort && !msg->rx.rtsDeasserted)
+		{
+			msg->rx.rtsDeasserted = true;
+			msg->rx.rtsDeassertCount++;
+			HAL_GPIO_WritePin(msg->rx.rtsPort, msg->rx.rtsPin, GPIO_PIN_SET);
+		}
+		return -1;
+	}
+
+	if(msg->rx.policy != UART_DMA_RX_DROP_OLDEST)
+	{
+		return -1;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq(); // the parser acquires and releases with interrupts disabled, so tail can be moved from here
+	if(msg->rx.acquired == 0)
+	{
+		for(index = msg->rx.ptr.tail; index != msg->rx.ptr.head; index++)
+		{
+			if(msg->rx.queue[index & (msg->rx.queueSize - 1)].sizeClass == sizeClass)
+			{
+				break;
+			}
+		}
+
+		while(index != msg->rx.ptr.head && RingBuff_SPSC_Count(&msg->rx.ptr) != 0 && (slot < 0 || more))
+		{
+			frame = &msg->rx.queue[RingBuff_SPSC_IndexOut(&msg->rx.ptr, msg->rx.queueSize)];
+			if(slot < 0 && frame->sizeClass == sizeClass)
+			{
+				slot = frame->slot; // slot stays used, it is given to the new frame
+			}
+			else if(frame->sizeClass == UART_DMA_RX_SMALL)
+			{
+				msg->rx.smallUsed[frame->slot] = false;
+			}
+			else
+			{
+				msg->rx.largeUsed[frame->slot] = false;
+			}
+			more = frame->more;
+			RingBuff_SPSC_Output(&msg->rx.ptr);
+			msg->rx.overflow++;
+		}
+	}
+	__set_PRIMASK(primask);
+
+	return slot;
+}
+
+/*
+ * Description: Hardware RTS only stops the sender when the USART data register is full, which never happens with DMA.
+ * 				So RTS is a GPIO driven from the free rx slots instead. It is deasserted (high) when fewer than
+ * 				UART_DMA_RTS_OFF_FREE_SLOTS are free and asserted (low) again once UART_DMA_RTS_ON_FREE_SLOTS are free.
+ * 				The slots that are left absorb what the sender has already started sending.
+ * 				Called when a slot is used in interrupt and when slots are released, so interrupts are disabled.
+ *
+ */
+static void UART_DMA_RxUpdateRts(UART_DMA_QueueStruct *msg)
+{
+	uint32_t primask;
+	uint32_t freeSlots = 0;
+	uint32_t i;
+
+	if(msg->rx.rtsPort == NULL)
+	{
+		return;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	for(i = 0; i < UART_DMA_RX_SMALL_COUNT; i++)
+	{
+		freeSlots += msg->rx.smallUsed[i] ? 0 : 1;
+	}
+	for(i = 0; i < UART_DMA_RX_LARGE_COUNT; i++)
+	{
+		freeSlots += msg->rx.largeUsed[i] ? 0 : 1;
+	}
+
+	if(!msg->rx.rtsDeasserted && freeSlots < UART_DMA_RTS_OFF_FREE_SLOTS)
+	{
+		msg->rx.rtsDeasserted = true;
+		msg->rx.rtsDeassertCount++;
+	}
+	else if(msg->rx.rtsDeasserted && freeSlots >= UART_DMA_RTS_ON_FREE_SLOTS)
+	{
+		msg->rx.rtsDeasserted = false;
+	}
+
+	HAL_GPIO_WritePin(msg->rx.rtsPort, msg->rx.rtsPin, msg->rx.rtsDeasserted ? GPIO_PIN_SET : GPIO_PIN_RESET);
+
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Description: Add the frame to the rx queue, or if the port is bridged, send it
+ *
+ */
+static void UART_DMA_RxQueueFrame(UART_DMA_QueueStruct *msg, uint8_t sizeClass, uint8_t slot, uint32_t size, bool more)
+{
+	UART_DMA_RxFrame *frame;
+	uint32_t depth;
+	uint32_t primask;
+
+	msg->stats.rxFrames++;
+	msg->stats.rxBytes += size;
+
+	if(msg->rx.bridge)
+	{
+		UART_DMA_RxBridgeFrame(msg, sizeClass, slot, size);
+		return;
+	}
+
+	frame = &msg->rx.queue[RingBuff_SPSC_IndexIn(&msg->rx.ptr, msg->rx.queueSize)];
+
+	frame->data = (sizeClass == UART_DMA_RX_SMALL) ? msg->rx.small[slot] : msg->rx.large[slot];
+	frame->size = size;
+	frame->sizeClass = sizeClass;
+	frame->slot = slot;
+	frame->more = more;
+
+	if(RingBuff_SPSC_Input(&msg->rx.ptr, msg->rx.queueSize) != 0)
+	{
+		// queue is full, free the slot again
+		if(sizeClass == UART_DMA_RX_SMALL)
+		{
+			msg->rx.smallUsed[slot] = false;
+		}
+		else
+		{
+			msg->rx.largeUsed[slot] = false;
+		}
+		msg->rx.overflow++;
+		return;
+	}
+
+	depth = msg->rx.ptr.head - msg->rx.ptr.tail;
+	if(depth > msg->stats.rxQueueHighWater)
+	{
+		msg->stats.rxQueueHighWater = depth;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	uartDMA_RxReadyPorts |= UART_DMA_PortMask(msg);
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Description: Send the rx slot with the bridge port. The slot is used as the DMA source and is freed on tx complete.
+ * 				There is a descriptor for every slot, so the bridge queue can't be full.
+ *
+ */
+static void UART_DMA_RxBridgeFrame(UART_DMA_QueueStruct *msg, uint8_t sizeClass, uint8_t slot, uint32_t size)
+{
+	UART_DMA_QueueStruct *to = msg->rx.bridge;
+	UART_DMA_TxBuffer *buffer;
+
+	buffer = &msg->rx.bridgeBuffer[(sizeClass == UART_DMA_RX_SMALL) ? slot : UART_DMA_RX_SMALL_COUNT + slot];
+	buffer->data = (sizeClass == UART_DMA_RX_SMALL) ? msg->rx.small[slot] : msg->rx.large[slot];
+	buffer->size = size;
+	buffer->refCount = 1;
+	buffer->release = UART_DMA_RxBridgeRelease;
+	buffer->owner = msg;
+
+	to->tx.bridgeQueue[RingBuff_SPSC_IndexIn(&to->tx.bridgePtr, UART_DMA_QUEUE_SIZE)] = buffer;
+	RingBuff_SPSC_Input(&to->tx.bridgePtr, UART_DMA_QUEUE_SIZE);
+
+	UART_DMA_SendMessage(to);
+}
+
+/*
+ * Description: Called on tx complete of the bridge port. Free the rx slot the frame was sent from.
+ * 				If rx couldn't be armed because every large slot was in use, it is armed again here,
+ * 				not on the next UART_DMA_CheckRxInterruptErrorFlag, so no bytes are lost waiting for the main loop.
+ *
+ */
+static void UART_DMA_RxBridgeRelease(UART_DMA_TxBuffer *buffer)
+{
+	UART_DMA_QueueStruct *msg = (UART_DMA_QueueStruct *)buffer->owner;
+	uint32_t index = buffer - msg->rx.bridgeBuffer;
+
+	if(index < UART_DMA_RX_SMALL_COUNT)
+	{
+		msg->rx.smallUsed[index] = false;
+	}
+	else
+	{
+		msg->rx.largeUsed[index - UART_DMA_RX_SMALL_COUNT] = false;
+	}
+
+	UART_DMA_RxUpdateRts(msg);
+
+	if(msg->rx.hal_status == HAL_BUSY && !msg->rx.circularMode && !msg->rx.autoBaud)
+	{
+		msg->rx.hal_status = HAL_OK;
+		UART_DMA_EnableRxInterrupt(msg);
+	}
+}
+
+/*
+ * Description: Bridge the rx of one port to the tx of another. Received frames are sent straight from the rx slot
+ * 				by the tx DMA of the other port, from the rx interrupt, so the main loop doesn't copy or forward them.
+ * 				The rx slot is freed on tx complete. Bridged frames are sent before messages in the tx ring.
+ * 				A port can only be bridged from one port. Returns -1 if to already has another source.
+ * 				Use to = NULL to go back to queuing frames for the main loop.
+ * 				In normal mode each bridged frame holds a large slot until it is sent, UART_DMA_RX_LARGE_COUNT is at least 3
+ * 				so a slot can be armed while two are being sent.
+ * 	example:
+ * 		UART_DMA_Bridge(&uart2, &uart1); // everything received on uart2 is sent out uart1
+ *
+ */
+int UART_DMA_Bridge(UART_DMA_QueueStruct *from, UART_DMA_QueueStruct *to)
+{
+	if(to == NULL)
+	{
+		if(from->rx.bridge)
+		{
+			from->rx.bridge->tx.bridgeSource = NULL;
+		}
+		from->rx.bridge = NULL;
+		return 0;
+	}
+
+	if(to->tx.bridgeSource != NULL && to->tx.bridgeSource != from)
+	{
+		return -1;
+	}
+
+	to->tx.bridgeSource = from;
+	from->rx.bridge = to;
+
+	return 0;
+}
+
+/*
+ * Description: Return 0 if no new message, 1 if there is message in msgToParse.
+ * 				The previous msgToParse is released first, so msgToParse stays valid until the next call.
+ * 				Don't mix with UART_DMA_RxAcquire/UART_DMA_RxAcquireAll on the same port.
+ */
+int UART_DMA_MsgRdy(UART_DMA_QueueStruct *msg)
+{
+	if(msg->rx.msgToParse)
+	{
+		UART_DMA_RxRelease(msg, 1);
+		msg->rx.msgToParse = NULL;
+	}
+
+	msg->rx.msgToParse = UART_DMA_RxAcquire(msg);
+
+	return (msg->rx.msgToParse != NULL) ? 1 : 0;
+}
+
+/*
+ * Description: Return the oldest frame without removing it from the queue, or NULL if there isn't one.
+ * 				The frame data can be parsed in place. It won't be reused until UART_DMA_RxRelease is called.
+ *
+ */
+UART_DMA_RxFrame * UART_DMA_RxAcquire(UART_DMA_QueueStruct *msg)
+{
+	UART_DMA_RxFrame *frame = NULL;
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq(); // with UART_DMA_RX_DROP_OLDEST the rx interrupt can drop frames that haven't been acquired
+	if(RingBuff_SPSC_Count(&msg->rx.ptr) != 0)
+	{
+		frame = &msg->rx.queue[RingBuff_SPSC_IndexOut(&msg->rx.ptr, msg->rx.queueSize)];
+		if(msg->rx.acquired == 0)
+		{
+			msg->rx.acquired = 1;
+		}
+	}
+	__set_PRIMASK(primask);
+
+	return frame;
+}
+
+/*
+ * Description: Get all frames that are ready, oldest first, up to maxFrames. Returns the number of frames.
+ * 				Call UART_DMA_RxRelease with the returned count when done with them.
+ * 	example:
+ * 		UART_DMA_RxFrame *frames[UART_DMA_QUEUE_SIZE];
+ * 		uint32_t count = UART_DMA_RxAcquireAll(&uart1, frames, UART_DMA_QUEUE_SIZE);
+ *
+ * 		for(i = 0; i < count; i++)
+ * 		{
+ * 			// parse frames[i]->data, frames[i]->size
+ * 		}
+ * 		UART_DMA_RxRelease(&uart1, count);
+ *
+ */
+uint32_t UART_DMA_RxAcquireAll(UART_DMA_QueueStruct *msg, UART_DMA_RxFrame *frames[], uint32_t maxFrames)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint32_t count;
+	uint32_t index = msg->rx.ptr.tail;
+	uint32_t i;
+
+	__disable_irq();
+	count = RingBuff_SPSC_Count(&msg->rx.ptr);
+	if(count > maxFrames)
+	{
+		count = maxFrames;
+	}
+	if(count > msg->rx.acquired)
+	{
+		msg->rx.acquired = count;
+	}
+	__set_PRIMASK(primask);
+
+	for(i = 0; i < count; i++)
+	{
+		frames[i] = &msg->rx.queue[(index + i) & (msg->rx.queueSize - 1)];
+	}
+
+	return count;
+}
+
+/*
+ * Description: Free the slots of the oldest count frames and remove them from the queue
+ *
+ */
+void UART_DMA_RxRelease(UART_DMA_QueueStruct *msg, uint32_t count)
+{
+	UART_DMA_RxFrame *frame;
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	while(count--)
+	{
+		if(RingBuff_SPSC_Count(&msg->rx.ptr) == 0)
+		{
+			break;
+		}
+		frame = &msg->rx.queue[RingBuff_SPSC_IndexOut(&msg->rx.ptr, msg->rx.queueSize)];
+
+		if(frame->sizeClass == UART_DMA_RX_SMALL)
+		{
+			msg->rx.smallUsed[frame->slot] = false;
+		}
+		else
+		{
+			msg->rx.largeUsed[frame->slot] = false;
+		}
+
+		RingBuff_SPSC_Output(&msg->rx.ptr);
+		if(msg->rx.acquired)
+		{
+			msg->rx.acquired--;
+		}
+	}
+	__set_PRIMASK(primask);
+
+	UART_DMA_RxUpdateRts(msg);
+}
+
+/*
+* Description: Add message to TX buffer. Returns 0 if added, -1 if there isn't enough room in the ring.
+* 				A message longer than UART_DMA_DATA_SIZE is split into consecutive fragments. Either all fragments are added or none.
+* 				Queued messages are never overwritten. Use UART_DMA_TX_GetMaxMessageSize to check before adding.
+* 				There is no completion callback, not even after the last fragment. Use UART_DMA_TX_SendBlock if one is needed.
+*/
+int UART_DMA_TX_AddMessageToBuffer(UART_DMA_QueueStruct *msg, uint8_t *data, uint32_t size)
+{
+	UART_DMA_TxSegment segment = {data, size};
+
+	return UART_DMA_TX_AddSegments(msg, UART_DMA_TX_PRIORITY_NORMAL, 0, &segment, 1);
+}
+
+/*
+ * Description: Send segments as one message, without concatenating them first. i.e. header, payload and trailer.
+ * 				Each segment is copied once, straight into the ring. Segments are packed into fragments of up to UART_DMA_DATA_SIZE,
+ * 				so small segments go out in one DMA transfer and the fragments of a long message are chained from tx complete.
+ * 				The segments can be reused as soon as this returns. Returns 0 if added, -1 if there isn't enough room in the ring.
+ * 	example:
+ * 		UART_DMA_TxSegment segments[3] = {{header, headerSize}, {payload, payloadSize}, {(uint8_t*)"\r\n", 2}};
+ *
+ * 		UART_DMA_TX_SendSegments(&uart2, segments, 3);
+ *
+ */
+int UART_DMA_TX_SendSegments(UART_DMA_QueueStruct *msg, const UART_DMA_TxSegment *segments, uint32_t count)
+{
+	return UART_DMA_TX_SendPriority(msg, UART_DMA_TX_PRIORITY_NORMAL, segments, count);
+}
+
+/*
+ * Description: Same as UART_DMA_TX_SendSegments but into the ring of priority, 0 to UART_DMA_TX_PRIORITIES - 1.
+ * 				When a transfer completes the next one is from the highest priority ring that isn't empty,
+ * 				so an urgent message only waits for the transfer in progress, not for everything queued before it.
+ * 				Messages of the same priority stay in order. Returns -1 if there isn't enough room in that ring.
+ * 	example:
+ * 		UART_DMA_TxSegment segment = {(uint8_t*)"FAULT OVERCURRENT\r\n", 19};
+ *
+ * 		UART_DMA_TX_SendPriority(&uart2, UART_DMA_TX_PRIORITY_URGENT, &segment, 1);
+ *
+ */
+int UART_DMA_TX_SendPriority(UART_DMA_QueueStruct *msg, uint32_t priority, const UART_DMA_TxSegment *segments, uint32_t count)
+{
+	return UART_DMA_TX_SendTimed(msg, priority, 0, segments, count);
+}
+
+/*
+ * Description: Same as UART_DMA_TX_SendPriority, but the message is dropped instead of sent if it is still queued
+ * 				timeToLive ms after this call, i.e. after a stall the bandwidth goes to data that is still useful.
+ * 				Expired messages are skipped when they reach the tail of their ring and counted in stats.txExpired.
+ * 				A message that has started to go out is always finished. timeToLive of 0 never expires.
+ * 	example:
+ * 		UART_DMA_TxSegment segment = {(uint8_t*)str, len};
+ *
+ * 		UART_DMA_TX_SendTimed(&uart2, UART_DMA_TX_PRIORITY_NORMAL, 100, &segment, 1); // ADC reading is no use after 100ms
+ *
+ */
+int UART_DMA_TX_SendTimed(UART_DMA_QueueStruct *msg, uint32_t priority, uint32_t timeToLive, const UART_DMA_TxSegment *segments, uint32_t count)
+{
+	if(priority >= UART_DMA_TX_PRIORITIES)
+	{
+		return -1;
+	}
+
+	if(UART_DMA_TX_AddSegments(msg, priority, timeToLive, segments, count) != 0)
+	{
+		return -1;
+	}
+
+	UART_DMA_SendMessage(msg);
+
+	return 0;
+}
+
+/*
+ * Description: Set the latest value of message id key, i.e. for periodic state telemetry where only the newest sample matters.
+ * 				If the previous value of key hasn't been sent yet it is replaced, so a slow link sends fewer samples
+ * 				instead of building a backlog. Each key keeps its slot once assigned, up to UART_DMA_TX_MAILBOX_COUNT keys per port.
+ * 				Values are sent after the higher priority rings, taking turns with the normal priority ring.
+ * 				data is copied and can be reused. Returns 0, or -1 if size is 0 or too big, or there is no free slot for a new key.
+ * 	example:
+ * 		len = sprintf(str, "POS %ld %ld\r\n", x, y);
+ * 		UART_DMA_TX_MailboxPut(&uart2, MSG_ID_POSITION, (uint8_t*)str, len);
+ *
+ */
+int UART_DMA_TX_MailboxPut(UART_DMA_QueueStruct *msg, uint16_t key, const uint8_t *data, uint32_t size)
+{
+	UART_DMA_TxMailbox *mailbox = NULL;
+	uint32_t primask;
+	uint32_t i;
+
+	if(size == 0 || size > UART_DMA_TX_MAILBOX_SIZE)
+	{
+		return -1;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq(); // the tx complete interrupt reads the slots
+	for(i = 0; i < UART_DMA_TX_MAILBOX_COUNT; i++)
+	{
+		if(msg->tx.mailbox[i].used && msg->tx.mailbox[i].key == key)
+		{
+			mailbox = &msg->tx.mailbox[i];
+			break;
+		}
+
+		if(mailbox == NULL && !msg->tx.mailbox[i].used)
+		{
+			mailbox = &msg->tx.mailbox[i]; // first free slot, used if key isn't found
+		}
+	}
+
+	if(mailbox == NULL)
+	{
+		msg->tx.overflow++;
+		__set_PRIMASK(primask);
+		return -1;
+	}
+
+	if(mailbox->used && mailbox->pending)
+	{
+		msg->stats.txMailboxReplaced++;
+	}
+
+	memcpy(mailbox->data, data, size);
+	mailbox->size = size;
+	mailbox->key = key;
+	mailbox->used = true;
+	mailbox->pending = true;
+	__set_PRIMASK(primask);
+
+	UART_DMA_SendMessage(msg);
+
+	return 0;
+}
+
+/*
+ * Description: Copy the segments into the ring as fragments of up to UART_DMA_DATA_SIZE.
+ * 				The space is checked for the worst case first, one pad plus a full fragment, so the message is never cut short.
+ * 				Fragments are consecutive in the ring so they are sent back to back, or merged in coalesce mode.
+ * 				The fragments are freed one by one from tx complete with nothing reported, so the caller can't tell when the message is out.
+ *
+ */
+static int UART_DMA_TX_AddSegments(UART_DMA_QueueStruct *msg, uint32_t priority, uint32_t timeToLive, const UART_DMA_TxSegment *segments, uint32_t count)
+{
+	UART_DMA_TxQueue *queue = &msg->tx.queue[priority];
+	uint16_t flags = 0;
+	uint32_t fragmentLength = UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + UART_DMA_DATA_SIZE);
+	uint32_t total = 0;
+	uint32_t needed;
+	uint32_t length;
+	uint32_t copied;
+	uint32_t segment = 0;
+	uint32_t offset = 0; // position in segments[segment]
+	uint32_t chunk;
+	uint8_t *ptr;
+	uint32_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		total += segments[i].size;
+	}
+
+	if(total == 0)
+	{
+		return 0; // nothing to send, an empty record would never complete
+	}
+
+	needed = (total / UART_DMA_DATA_SIZE) * fragmentLength + UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + (total % UART_DMA_DATA_SIZE));
+	if(total > UART_DMA_DATA_SIZE)
+	{
+		needed += fragmentLength; // pad at the end of the ring
+	}
+	else if(UART_DMA_TX_MaxMessageSize(queue) >= total)
+	{
+		needed = 0; // fits in one fragment, Reserve checks the space
+	}
+
+	if(UART_DMA_TX_FreeBytes(queue) < needed)
+	{
+		msg->tx.overflow++;
+		return -1;
+	}
+
+	while(total)
+	{
+		length = (total > UART_DMA_DATA_SIZE) ? UART_DMA_DATA_SIZE : total;
+		ptr = UART_DMA_TX_Reserve(msg, queue, length);
+		if(ptr == NULL)
+		{
+			return -1;
+		}
+
+		for(copied = 0; copied < length; copied += chunk)
+		{
+			while(offset >= segments[segment].size) // skip to the next segment with data left
+			{
+				segment++;
+				offset = 0;
+			}
+
+			chunk = segments[segment].size - offset;
+			if(chunk > length - copied)
+			{
+				chunk = length - copied;
+			}
+			memcpy(&ptr[copied], &segments[segment].data[offset], chunk);
+			offset += chunk;
+		}
+
+		UART_DMA_TX_Commit(msg, queue, length, flags, timeToLive);
+		flags = UART_DMA_TX_FLAG_CONTINUED;
+		total -= length;
+	}
+
+	return 0;
+}
+
+/*
+ * Description: printf into the tx ring. The next slot is reserved and the text is formatted straight into it,
+ * 				then it is committed and sent, so each byte is written once. The text is cut off at UART_DMA_DATA_SIZE.
+ * 				Uses UART_DMA_Format, not newlib's vfprintf. See UART_DMA_Format for what is supported.
+ * 				Returns the number of bytes queued, or -1 if there isn't room in the ring for a full slot.
+ * 	example:
+ * 		UART_DMA_Printf(&uart2, "T %.2q V %u\r\n", temperatureCenti, milliVolts); // T 23.45 V 3300
+ *
+ */
+int UART_DMA_Printf(UART_DMA_QueueStruct *msg, const char *format, ...)
+{
+	UART_DMA_TxQueue *queue = &msg->tx.queue[UART_DMA_TX_PRIORITY_NORMAL];
+	va_list args;
+	uint32_t size;
+	char *ptr;
+
+	ptr = (char *)UART_DMA_TX_Reserve(msg, queue, UART_DMA_DATA_SIZE);
+	if(ptr == NULL)
+	{
+		return -1;
+	}
+
+	va_start(args, format);
+	size = UART_DMA_Format(ptr, UART_DMA_DATA_SIZE, format, args);
+	va_end(args);
+
+	if(size == 0)
+	{
+		return 0; // nothing to send, an empty record would never complete
+	}
+
+	UART_DMA_TX_Commit(msg, queue, size, 0, 0);
+
+	UART_DMA_SendMessage(msg);
+
+	return size;
+}
+
+/*
+ * Description: Format into buf with UART_DMA_Format, i.e. to build a message longer than UART_DMA_DATA_SIZE in pieces.
+ * 				Writes at most size bytes, no null terminator. Returns the length.
+ * 	example:
+ * 		length = UART_DMA_Sprintf(str, sizeof(str), "ADC");
+ * 		for(i = 0; i < 8; i++)
+ * 		{
+ * 			length += UART_DMA_Sprintf(&str[length], sizeof(str) - length, " %u", adc[i]);
+ * 		}
+ *
+ */
+uint32_t UART_DMA_Sprintf(char *buf, uint32_t size, const char *format, ...)
+{
+	va_list args;
+	uint32_t length;
+
+	va_start(args, format);
+	length = UART_DMA_Format(buf, size, format, args);
+	va_end(args);
+
+	return length;
+}
+
+/*
+ * Description: Small integer only formatter. Writes at most size bytes to buf, no null terminator. Returns the length.
+ * 				%d %i %u %x %X %c %s %% with optional '-', '0', width and .precision. l and h are accepted and ignored.
+ * 				%.Nq prints a signed fixed point integer with N decimals, i.e. %.3q of 12345 is 12.345
+ *
+ */
+static uint32_t UART_DMA_Format(char *buf, uint32_t size, const char *format, va_list args)
+{
+	char tmp[16];
+	const char *str;
+	uint32_t len = 0;
+	uint32_t strLen;
+	uint32_t width;
+	uint32_t precision;
+	bool hasPrecision;
+	bool leftAlign;
+	bool zeroPad;
+	bool negative;
+	uint32_t value;
+	uint32_t base;
+	uint32_t divisor;
+	uint32_t i;
+	char c;
+
+	while((c = *format++) != 0 && len < size)
+	{
+		if(c != '%')
+		{
+			buf[len++] = c;
+			continue;
+		}
+
+		leftAlign = false;
+		zeroPad = false;
+		width = 0;
+		precision = 0;
+		hasPrecision = false;
+
+		for(;; format++)
+		{
+			if(*format == '-')
+			{
+				leftAlign = true;
+			}
+			else if(*format == '0')
+			{
+				zeroPad = true;
+			}
+			else
+			{
+				break;
+			}
+		}
+		while(*format >= '0' && *format <= '9')
+		{
+			width = width * 10 + (*format++ - '0');
+		}
+		if(*format == '.')
+		{
+			format++;
+			hasPrecision = true;
+			while(*format >= '0' && *format <= '9')
+			{
+				precision = precision * 10 + (*format++ - '0');
+			}
+		}
+		while(*format == 'l' || *format == 'h')
+		{
+			format++;
+		}
+
+		c = *format++;
+		if(c == 0)
+		{
+			break;
+		}
+
+		str = tmp;
+		strLen = 0;
+		negative = false;
+		base = 10;
+
+		switch(c)
+		{
+		case 'c':
+			tmp[strLen++] = (char)va_arg(args, int);
+			break;
+		case 's':
+			str = va_arg(args, const char *);
+			if(str == NULL)
+			{
+				str = "(null)";
+			}
+			while(str[strLen] && (!hasPrecision || strLen < precision))
+			{
+				strLen++;
+			}
+			break;
+		case 'd':
+		case 'i':
+		case 'q':
+			value = (uint32_t)va_arg(args, int32_t);
+			if((int32_t)value < 0)
+			{
+				negative = true;
+				value = 0 - value;
+			}
+			if(c != 'q' || !hasPrecision)
+			{
+				precision = 0;
+			}
+			if(precision > 9)
+			{
+				precision = 9;
+			}
+			// fall through
+		case 'u':
+		case 'x':
+		case 'X':
+			if(c == 'u' || c == 'x' || c == 'X')
+			{
+				value = va_arg(args, uint32_t);
+				precision = 0;
+				base = (c == 'u') ? 10 : 16;
+			}
+
+			// digits are written from the end of tmp
+			i = sizeof(tmp);
+			divisor = 0;
+			do
+			{
+				tmp[--i] = "0123456789ABCDEF"[value % base] | ((c == 'x') ? 0x20 : 0); // 0x20 makes A-F lower case, digits are unchanged
+				value /= base;
+				if(precision && ++divisor == precision)
+				{
+					tmp[--i] = '.';
+					if(value == 0)
+					{
+						tmp[--i] = '0';
+					}
+				}
+			}while(value || (precision && divisor < precision));
+			if(negative)
+			{
+				tmp[--i] = '-';
+			}
+			str = &tmp[i];
+			strLen = sizeof(tmp) - i;
+			break;
+		default: // %% or unknown, print the character
+			tmp[strLen++] = c;
+			break;
+		}
+
+		if(zeroPad && !leftAlign && str[0] == '-' && width > strLen && len < size)
+		{
+			buf[len++] = '-'; // sign goes before the zeros
+			str++;
+			strLen--;
+			width--;
+		}
+		while(!leftAlign && width > strLen && len < size)
+		{
+			buf[len++] = zeroPad ? '0' : ' ';
+			width--;
+		}
+		for(i = 0; i < strLen && len < size; i++)
+		{
+			buf[len++] = str[i];
+		}
+		while(leftAlign && width > strLen && len < size)
+		{
+			buf[len++] = ' ';
+			width--;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Description: Queue a zero copy buffer. The queue takes ownership of one reference of the buffer.
+ * 				The DMA transmits directly from buffer->data and the reference is released on tx complete.
+ * 				A buffer larger than UART_DMA_TX_MAX_TRANSFER is queued as several transfers that each hold a reference,
+ * 				so the release callback is only called once the last byte is sent.
+ * 				If the ring is full the reference is released and -1 is returned.
+ * 	example:
+ * 		UART_DMA_TxBuffer *buffer = UART_DMA_TxBufferAlloc();
+ * 		if(buffer)
+ * 		{
+ * 			buffer->size = sprintf((char*)buffer->data, "ADC %lu\r\n", adcValue);
+ * 			UART_DMA_TX_AddBufferToQueue(&uart2, buffer);
+ * 		}
+ *
+ */
+int UART_DMA_TX_AddBufferToQueue(UART_DMA_QueueStruct *msg, UART_DMA_TxBuffer *buffer)
+{
+	UART_DMA_TxQueue *queue = &msg->tx.queue[UART_DMA_TX_PRIORITY_NORMAL];
+	uint32_t recordLength = UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + sizeof(UART_DMA_TxBufferRef));
+	uint32_t transfers = (buffer->size + UART_DMA_TX_MAX_TRANSFER - 1) / UART_DMA_TX_MAX_TRANSFER;
+	UART_DMA_TxBufferRef ref;
+	uint32_t length;
+	uint8_t *ptr;
+
+	if(transfers == 0)
+	{
+		UART_DMA_TxBufferRelease(buffer); // nothing to send, an empty transfer would never complete
+		return 0;
+	}
+
+	if(UART_DMA_TX_FreeBytes(queue) < (transfers + 1) * recordLength) // + 1 for a pad at the end of the ring
+	{
+		msg->tx.overflow++;
+		UART_DMA_TxBufferRelease(buffer);
+		return -1;
+	}
+
+	ref.buffer = buffer;
+	ref.offset = 0;
+	do
+	{
+		length = buffer->size - ref.offset;
+		if(length > UART_DMA_TX_MAX_TRANSFER)
+		{
+			length = UART_DMA_TX_MAX_TRANSFER;
+		}
+
+		if(ref.offset != 0)
+		{
+			UART_DMA_TxBufferRetain(buffer); // one reference per transfer
+		}
+
+		ptr = UART_DMA_TX_Reserve(msg, queue, sizeof(UART_DMA_TxBufferRef));
+		memcpy(ptr, &ref, sizeof(UART_DMA_TxBufferRef));
+		UART_DMA_TX_Commit(msg, queue, length, UART_DMA_TX_FLAG_BUFFER, 0);
+
+		ref.offset += length;
+	}while(ref.offset < buffer->size);
+
+	UART_DMA_SendMessage(msg);
+
+	return 0;
+}
+
+/*
+ * Description: Send a large block, i.e. a log dump, without copying it. block is a descriptor owned by the caller.
+ * 				data must not change until done is called, which is once, after the whole block is sent. done can be NULL.
+ * 				Returns -1 if the ring is full, done is still called.
+ * 	example:
+ * 		static UART_DMA_TxBuffer logBlock;
+ *
+ * 		UART_DMA_TX_SendBlock(&uart2, &logBlock, logData, logSize, LogSent);
+ *
+ */
+int UART_DMA_TX_SendBlock(UART_DMA_QueueStruct *msg, UART_DMA_TxBuffer *block, const uint8_t *data, uint32_t size, UART_DMA_TxBufferCallback done)
+{
+	block->data = (uint8_t *)data;
+	block->size = size;
+	block->refCount = 1;
+	block->release = done;
+	block->owner = NULL;
+
+	return UART_DMA_TX_AddBufferToQueue(msg, block);
+}
+
+/*
+ * Description: Return the number of free bytes in the normal priority tx ring. Each message uses 12 header bytes plus its size rounded up to 4.
+ *
+ */
+uint32_t UART_DMA_TX_GetFreeBytes(UART_DMA_QueueStruct *msg)
+{
+	return UART_DMA_TX_FreeBytes(&msg->tx.queue[UART_DMA_TX_PRIORITY_NORMAL]);
+}
+
+/*
+ * Description: Return the number of free bytes in the ring of queue
+ *
+ */
+static uint32_t UART_DMA_TX_FreeBytes(UART_DMA_TxQueue *queue)
+{
+	return queue->size - (queue->head - queue->tail);
+}
+
+/*
+ * Description: With CTS flow control (Hardware Flow Control set to CTS in CubeMX), the USART holds the tx DMA while CTS is high.
+ * 				Only this port waits, the other ports have their own DMA channels. Messages keep queuing until the ring is full.
+ * 				Returns false while the other end is holding CTS high, so a producer can hold off. Always true without CTS.
+ *
+ */
+bool UART_DMA_TX_IsClearToSend(UART_DMA_QueueStruct *msg)
+{
+	if(msg->huart->Init.HwFlowCtl != UART_HWCONTROL_CTS && msg->huart->Init.HwFlowCtl != UART_HWCONTROL_RTS_CTS)
+	{
+		return true;
+	}
+
+	return (msg->huart->Instance->ISR & USART_ISR_CTS) != 0; // CTS bit is the inverse of the pin
+}
+
+/*
+ * Description: Return the largest message size that can be added right now as one fragment, up to UART_DMA_DATA_SIZE,
+ * 				to the normal priority ring. This accounts for the header and for the pad needed when the message doesn't fit
+ * 				before the end of the ring. The free space only grows until the next message is added, so the size stays valid for the producer.
+ *
+ */
+uint32_t UART_DMA_TX_GetMaxMessageSize(UART_DMA_QueueStruct *msg)
+{
+	return UART_DMA_TX_MaxMessageSize(&msg->tx.queue[UART_DMA_TX_PRIORITY_NORMAL]);
+}
+
+/*
+ * Description: UART_DMA_TX_GetMaxMessageSize for the ring of queue
+ *
+ */
+static uint32_t UART_DMA_TX_MaxMessageSize(UART_DMA_TxQueue *queue)
+{
+	uint32_t freeBytes = UART_DMA_TX_FreeBytes(queue);
+	uint32_t toEnd = queue->size - (queue->head & (queue->size - 1));
+	uint32_t length;
+
+	length = (freeBytes < toEnd) ? freeBytes : toEnd; // fits before the end of the ring
+	if(freeBytes > toEnd && freeBytes - toEnd > length)
+	{
+		length = freeBytes - toEnd; // fits at index 0 after a pad
+	}
+
+	if(length <= sizeof(UART_DMA_TxHeader))
+	{
+		return 0;
+	}
+
+	length -= sizeof(UART_DMA_TxHeader);
+
+	return (length > UART_DMA_DATA_SIZE) ? UART_DMA_DATA_SIZE : length;
+}
+
+/*
+ * Description: Return pointer in the tx ring where size bytes of data can be written, or NULL if the ring is full.
+ * 				A message is never split. If it doesn't fit before the end of the ring, a pad header is written
+ * 				and the message starts over at index 0 so it can be sent with one DMA transfer.
+ * 				Call UART_DMA_TX_Commit after the data is written. The pad is only made visible by UART_DMA_TX_Commit,
+ * 				together with the message, so tx complete never finds a pad followed by a message that isn't written yet.
+ *
+ */
+static uint8_t * UART_DMA_TX_Reserve(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, uint32_t size)
+{
+	UART_DMA_TxHeader *header;
+	uint32_t length = UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + size);
+	uint32_t offset = queue->head & (queue->size - 1);
+	uint32_t pad = 0;
+
+	if(queue->size - offset < length)
+	{
+		pad = queue->size - offset;
+	}
+
+	if(UART_DMA_TX_FreeBytes(queue) < pad + length)
+	{
+		msg->tx.overflow++;
+		return NULL;
+	}
+
+	queue->reservedPad = pad;
+	if(pad)
+	{
+		header = (UART_DMA_TxHeader *)&queue->ring[offset]; // at least 4 bytes are left, enough for size and flags
+		header->size = 0;
+		header->flags = UART_DMA_TX_FLAG_PAD;
+		offset = 0;
+	}
+
+	return &queue->ring[offset + sizeof(UART_DMA_TxHeader)];
+}
+
+/*
+ * Description: Write the header for the data reserved with UART_DMA_TX_Reserve and make it visible to UART_DMA_SendMessage
+ *
+ */
+static void UART_DMA_TX_Commit(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, uint32_t size, uint16_t flags, uint32_t timeToLive)
+{
+	UART_DMA_TxHeader *header = (UART_DMA_TxHeader *)&queue->ring[(queue->head + queue->reservedPad) & (queue->size - 1)];
+	uint32_t dataSize = (flags & UART_DMA_TX_FLAG_BUFFER) ? sizeof(UART_DMA_TxBufferRef) : size;
+	uint32_t used;
+
+	header->size = size;
+	header->flags = flags;
+	header->queuedTick = HAL_GetTick();
+	header->timeToLive = timeToLive;
+	__DMB(); // pad, header and data must be written before head is moved
+	queue->head += queue->reservedPad + UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + dataSize);
+	queue->reservedPad = 0;
+
+	msg->stats.txMessages++;
+	used = queue->head - queue->tail;
+	if(used > msg->stats.txRingHighWater)
+	{
+		msg->stats.txRingHighWater = used;
+	}
+}
+
+/*
+ * Description: This will be called from UART_DMA_NotifyUser, from HAL_UART_TxCpltCallback or from the rx interrupt of a bridged port.
+ * 				The message is sent directly from the ring. The ring space is freed on tx complete.
+ * 				In coalesce mode, consecutive pending messages are merged and sent as one transfer.
+ * 				Interrupts are disabled while checking and starting the transfer so two callers can't both start one.
+ *
+ */
+void UART_DMA_SendMessage(UART_DMA_QueueStruct * msg)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	UART_DMA_TX_Start(msg);
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Description: Start the next transfer if there isn't one in progress. Bridged frames are sent first, then the highest priority ring.
+ * 				Pending mailbox values go before the normal priority ring, but not twice in a row while it has messages.
+ *
+ */
+static void UART_DMA_TX_Start(UART_DMA_QueueStruct * msg)
+{
+	UART_DMA_TxQueue *queue;
+	UART_DMA_TxHeader *header;
+	UART_DMA_TxBuffer *buffer = NULL;
+	UART_DMA_TxBufferRef ref;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t length;
+	uint32_t count = 1;
+	uint32_t priority;
+
+	//if(msg->huart->gState == HAL_UART_STATE_READY) // this hasn't been tested yet but could take place of txPending
+	if(!msg->tx.txPending && !msg->rx.autoBaud && !msg->tx.baudReady) // If no message is being sent then send message in queue. Nothing is sent until the baud rate is known
+	{
+		if(RingBuff_SPSC_Count(&msg->tx.bridgePtr))
+		{
+			buffer = msg->tx.bridgeQueue[RingBuff_SPSC_IndexOut(&msg->tx.bridgePtr, UART_DMA_QUEUE_SIZE)];
+			RingBuff_SPSC_Output(&msg->tx.bridgePtr);
+			data = buffer->data;
+			size = buffer->size;
+			length = 0; // not in the ring
+
+			msg->tx.txPending = true;
+			msg->tx.inFlightBytes = length;
+			msg->tx.bufferInFlight = buffer;
+
+			if(HAL_UART_Transmit_DMA(msg->huart, data, size) == HAL_OK)
+			{
+				msg->stats.txTransfers++;
+				msg->stats.txBytes += size;
+			}
+			else
+			{
+				msg->tx.txPending = false;
+				msg->tx.bufferInFlight = NULL;
+				UART_DMA_TxBufferRelease(buffer); // frame is dropped
+			}
+			return;
+		}
+
+		header = UART_DMA_TX_NextMessage(msg, &priority);
+		if(header == NULL && msg->tx.baudPending)
+		{
+			msg->tx.baudReady = true; // everything queued before UART_DMA_SetBaudRate has been sent, UART_DMA_CheckRxInterruptErrorFlag switches
+			return;
+		}
+
+		if(!msg->tx.baudPending && (header == NULL || (priority == UART_DMA_TX_PRIORITY_NORMAL && !msg->tx.mailboxLast)))
+		{
+			if(UART_DMA_TX_StartMailbox(msg) == 0)
+			{
+				return;
+			}
+		}
+		msg->tx.mailboxLast = false;
+
+		if(header == NULL)
+		{
+			return; // nothing to send
+		}
+
+		queue = &msg->tx.queue[priority];
+		data = (uint8_t *)header + sizeof(UART_DMA_TxHeader);
+		size = header->size;
+
+		if(header->flags & UART_DMA_TX_FLAG_BUFFER)
+		{
+			memcpy(&ref, data, sizeof(UART_DMA_TxBufferRef));
+			buffer = ref.buffer;
+			data = buffer->data + ref.offset;
+			length = UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + sizeof(UART_DMA_TxBufferRef));
+			UART_DMA_TX_RecordLatency(msg, priority, header);
+		}
+		else if(msg->tx.coalesceMode)
+		{
+			size = UART_DMA_TX_Coalesce(msg, queue, priority, &length, &count);
+			if(count > 1)
+			{
+				data = msg->tx.coalesceBuffer;
+			}
+		}
+		else
+		{
+			length = UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + size);
+			UART_DMA_TX_RecordLatency(msg, priority, header);
+		}
+
+		// set before starting the DMA in case tx complete interrupt happens right away
+		msg->tx.txPending = true;
+		msg->tx.inFlightBytes = length;
+		msg->tx.inFlightPriority = priority;
+		msg->tx.bufferInFlight = buffer;
+
+		if(HAL_UART_Transmit_DMA(msg->huart, data, size) == HAL_OK)
+		{
+			msg->stats.txTransfers++;
+			msg->stats.txBytes += size;
+			if(count > 1)
+			{
+				msg->tx.coalescedMessages += count;
+				msg->tx.interruptsSaved += count - 1;
+			}
+		}
+		else
+		{
+			msg->tx.txPending = false;
+			msg->tx.inFlightBytes = 0;
+			msg->tx.bufferInFlight = NULL;
+		}
+	}
+}
+
+/*
+ * Description: Return the message at the tail of the highest priority ring that has one, or NULL if there is nothing to send.
+ * 				A pad at the tail is skipped, and so are expired messages. While a baud rate change is pending, a ring that has sent
+ * 				everything queued before UART_DMA_SetBaudRate is held, so no message is sent at the wrong rate.
+ *
+ */
+static UART_DMA_TxHeader * UART_DMA_TX_NextMessage(UART_DMA_QueueStruct *msg, uint32_t *priority)
+{
+	UART_DMA_TxQueue *queue;
+	UART_DMA_TxHeader *header;
+	uint32_t tick = HAL_GetTick();
+	int i;
+
+	for(i = UART_DMA_TX_PRIORITIES - 1; i >= 0; i--)
+	{
+		queue = &msg->tx.queue[i];
+		while(queue->head != queue->tail && !(msg->tx.baudPending && queue->tail == queue->baudSwitchAt))
+		{
+			header = (UART_DMA_TxHeader *)&queue->ring[queue->tail & (queue->size - 1)];
+			if(header->flags & UART_DMA_TX_FLAG_PAD)
+			{
+				queue->tail += queue->size - (queue->tail & (queue->size - 1));
+				continue;
+			}
+
+			if(!(header->flags & UART_DMA_TX_FLAG_CONTINUED))
+			{
+				queue->dropping = UART_DMA_TX_IsExpired(header, tick);
+			}
+
+			if(!queue->dropping)
+			{
+				*priority = i;
+				return header;
+			}
+
+			UART_DMA_TX_Drop(msg, queue, header);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Description: Return true if header is the first fragment of a message whose time to live has run out
+ *
+ */
+static bool UART_DMA_TX_IsExpired(UART_DMA_TxHeader *header, uint32_t tick)
+{
+	if(header->flags & UART_DMA_TX_FLAG_CONTINUED)
+	{
+		return false;
+	}
+
+	return header->timeToLive != 0 && tick - header->queuedTick >= header->timeToLive;
+}
+
+/*
+ * Description: Free the message at the tail of queue without sending it. Called with no transfer in progress.
+ *
+ */
+static void UART_DMA_TX_Drop(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, UART_DMA_TxHeader *header)
+{
+	UART_DMA_TxBufferRef ref;
+
+	if(header->flags & UART_DMA_TX_FLAG_BUFFER)
+	{
+		memcpy(&ref, (uint8_t *)header + sizeof(UART_DMA_TxHeader), sizeof(UART_DMA_TxBufferRef));
+		UART_DMA_TxBufferRelease(ref.buffer);
+		queue->tail += UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + sizeof(UART_DMA_TxBufferRef));
+	}
+	else
+	{
+		queue->tail += UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + header->size);
+	}
+
+	if(!(header->flags & UART_DMA_TX_FLAG_CONTINUED))
+	{
+		msg->stats.txExpired++;
+	}
+}
+
+/*
+ * Description: Send the next pending mailbox value, starting at mailboxNext. The value is copied to coalesceBuffer first,
+ * 				so UART_DMA_TX_MailboxPut can replace it while it is being sent.
+ * 				Returns 0 if a transfer was started or tried, -1 if no value is pending.
+ *
+ */
+static int UART_DMA_TX_StartMailbox(UART_DMA_QueueStruct *msg)
+{
+	UART_DMA_TxMailbox *mailbox;
+	uint32_t index;
+	uint32_t i;
+
+	for(i = 0; i < UART_DMA_TX_MAILBOX_COUNT; i++)
+	{
+		index = (msg->tx.mailboxNext + i) % UART_DMA_TX_MAILBOX_COUNT;
+		mailbox = &msg->tx.mailbox[index];
+		if(!mailbox->pending)
+		{
+			continue;
+		}
+
+		memcpy(msg->tx.coalesceBuffer, mailbox->data, mailbox->size);
+		mailbox->pending = false;
+		msg->tx.mailboxNext = index + 1;
+		msg->tx.mailboxLast = true;
+
+		msg->tx.txPending = true;
+		msg->tx.inFlightBytes = 0; // not in the ring
+		msg->tx.bufferInFlight = NULL;
+
+		if(HAL_UART_Transmit_DMA(msg->huart, msg->tx.coalesceBuffer, mailbox->size) == HAL_OK)
+		{
+			msg->stats.txTransfers++;
+			msg->stats.txBytes += mailbox->size;
+			msg->stats.txMailboxSent++;
+		}
+		else
+		{
+			msg->tx.txPending = false;
+			mailbox->pending = true; // try again on the next call
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Description: Merge consecutive pending messages starting at tail into coalesceBuffer, up to UART_DMA_TX_COALESCE_SIZE.
+ * 				Zero copy buffers are not merged, they are sent on their own. Only messages of one priority are merged.
+ * 				Returns the total size, length is the ring bytes used and count is the number of messages.
+ * 				If only one message is available it isn't copied, it is sent from the ring.
+ *
+ */
+static uint32_t UART_DMA_TX_Coalesce(UART_DMA_QueueStruct *msg, UART_DMA_TxQueue *queue, uint32_t priority, uint32_t *length, uint32_t *count)
+{
+	UART_DMA_TxHeader *header;
+	uint32_t index = queue->tail;
+	uint32_t total = 0;
+	uint32_t recordLength;
+	uint32_t tick = HAL_GetTick();
+
+	*length = 0;
+	*count = 0;
+	while(index != queue->head)
+	{
+		if(msg->tx.baudPending && index == queue->baudSwitchAt) // don't merge across a baud rate change, checked first as it can be on a pad
+		{
+			break;
+		}
+
+		header = (UART_DMA_TxHeader *)&queue->ring[index & (queue->size - 1)];
+		if(header->flags & UART_DMA_TX_FLAG_PAD)
+		{
+			recordLength = queue->size - (index & (queue->size - 1));
+			index += recordLength;
+			*length += recordLength;
+			continue;
+		}
+
+		if((header->flags & UART_DMA_TX_FLAG_BUFFER) || total + header->size > UART_DMA_TX_COALESCE_SIZE
+				|| UART_DMA_TX_IsExpired(header, tick)) // left for UART_DMA_TX_NextMessage to drop
+		{
+			break;
+		}
+
+		memcpy(&msg->tx.coalesceBuffer[total], (uint8_t *)header + sizeof(UART_DMA_TxHeader), header->size);
+		total += header->size;
+		UART_DMA_TX_RecordLatency(msg, priority, header);
+
+		recordLength = UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + header->size);
+		index += recordLength;
+		*length += recordLength;
+		(*count)++;
+	}
+
+	if(*count <= 1)
+	{
+		header = (UART_DMA_TxHeader *)&queue->ring[queue->tail & (queue->size - 1)];
+		if(*count == 0)
+		{
+			UART_DMA_TX_RecordLatency(msg, priority, header); // it wasn't merged, i.e. it is larger than coalesceBuffer
+		}
+		*count = 1;
+		*length = UART_DMA_TX_ALIGN(sizeof(UART_DMA_TxHeader) + header->size);
+		return header->size;
+	}
+
+	return total;
+}
+
+/*
+ * Description: Add the time header waited in its ring, from being added to the start of its transfer, to the stats of priority
+ *
+ */
+static void UART_DMA_TX_RecordLatency(UART_DMA_QueueStruct *msg, uint32_t priority, UART_DMA_TxHeader *header)
+{
+	uint32_t latency = HAL_GetTick() - header->queuedTick;
+
+	msg->stats.txLatencyTotal[priority] += latency;
+	msg->stats.txLatencyCount[priority]++;
+	if(latency > msg->stats.txLatencyMax[priority])
+	{
+		msg->stats.txLatencyMax[priority] = latency;
+	}
+}
+
+/*
+ * Description: Find the oversampling and clock prescaler that give the least error for baudRate from the port's kernel clock.
+ * 				Uses the same BRR calculation as the HAL. Oversampling by 16 is used unless by 8 has less error,
+ * 				by 8 is needed above kernel clock / 16, i.e. above 10.625 Mbaud from 170 MHz.
+ * 				Returns 0 and fills in config, or -1 if no setting is in the BRR range.
+ *
+ */
+int UART_DMA_CalcBaudRate(UART_HandleTypeDef *huart, uint32_t baudRate, UART_DMA_BaudConfig *config)
+{
+	uint32_t clock = UART_DMA_GetKernelClock(huart);
+	uint32_t clockPres;
+	uint32_t usartdiv;
+	uint32_t actual;
+	uint32_t bestError = UINT32_MAX;
+	uint32_t error;
+	uint32_t prescaler;
+	uint32_t sampling;
+
+	if(clock == 0 || baudRate == 0)
+	{
+		return -1;
+	}
+
+	config->baudRate = baudRate;
+	for(prescaler = UART_PRESCALER_DIV1; prescaler <= UART_PRESCALER_DIV256; prescaler++)
+	{
+		clockPres = clock / UARTPrescTable[prescaler];
+
+		for(sampling = 0; sampling < 2; sampling++)
+		{
+			if(UART_INSTANCE_LOWPOWER(huart))
+			{
+				if(sampling) // LPUART has no oversampling setting
+				{
+					break;
+				}
+				if(clockPres < 3 * baudRate || clockPres / 4096 > baudRate) // 4096 * baudRate overflows above 1048575 baud
+				{
+					continue;
+				}
+				usartdiv = UART_DIV_LPUART(clock, baudRate, prescaler);
+				if(usartdiv < 0x300 || usartdiv > 0xFFFFF)
+				{
+					continue;
+				}
+				actual = (uint32_t)(((uint64_t)clockPres * 256) / usartdiv);
+			}
+			else
+			{
+				usartdiv = sampling ? UART_DIV_SAMPLING8(clock, baudRate, prescaler) : UART_DIV_SAMPLING16(clock, baudRate, prescaler);
+				if(usartdiv < 0x10 || usartdiv > 0xFFFF)
+				{
+					continue;
+				}
+				actual = sampling ? (clockPres * 2) / usartdiv : clockPres / usartdiv;
+			}
+
+			error = (actual > baudRate) ? actual - baudRate : baudRate - actual;
+			if(error < bestError) // strictly less, so by 16 and the smaller prescaler are kept on a tie
+			{
+				bestError = error;
+				config->actualBaud = actual;
+				config->overSampling = sampling ? UART_OVERSAMPLING_8 : UART_OVERSAMPLING_16;
+				config->clockPrescaler = prescaler;
+			}
+		}
+	}
+
+	if(bestError == UINT32_MAX)
+	{
+		return -1;
+	}
+
+	config->errorPpm = (int32_t)((((int64_t)config->actualBaud - baudRate) * 1000000) / baudRate);
+
+	return 0;
+}
+
 /*
- * Description: assign uart instance to data structure, if variable was not assigned during instantiation
- * 	example: UART_DMA_RxInit(&uartDMA_RXMsg, &huart2);
+ * Description: Change the baud rate without losing tx data. Messages already queued are sent at the old rate,
+ * 				then the port is switched and anything queued after this call is sent at the new rate.
+ * 				Rx is restarted at the new rate, bytes received during the switch may be lost.
+ * 				Returns 0, or -1 if the error would be more than UART_DMA_BAUD_MAX_ERROR_PPM. config can be NULL.
+ * 	example:
+ * 		UART_DMA_BaudConfig config;
+ *
+ * 		if(UART_DMA_SetBaudRate(&uart1, 3000000, &config) == 0)
+ * 		{
+ * 			// config.actualBaud, config.errorPpm
+ * 		}
  *
  */
-void UART_DMA_Init(UART_DMA_QueueStruct *msg, UART_HandleTypeDef *huart)
+int UART_DMA_SetBaudRate(UART_DMA_QueueStruct *msg, uint32_t baudRate, UART_DMA_BaudConfig *config)
 {
-	msg->huart = huart;
+	UART_DMA_BaudConfig newConfig;
+	uint32_t primask;
+	uint32_t i;
+
+	if(UART_DMA_CheckBaudRate(msg->huart, baudRate, &newConfig) != 0)
+	{
+		return -1;
+	}
+
+	if(config)
+	{
+		*config = newConfig;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	msg->tx.baudConfig = newConfig;
+	for(i = 0; i < UART_DMA_TX_PRIORITIES; i++)
+	{
+		msg->tx.queue[i].baudSwitchAt = msg->tx.queue[i].head;
+	}
+	msg->tx.baudPending = true;
+	__set_PRIMASK(primask);
+
+	UART_DMA_SendMessage(msg); // sets tx.baudReady now if nothing is being sent
+
+	return 0;
 }
 
 /*
- * Description: Enable rx interrupt
+ * Description: Return 0 if baudRate can be done within UART_DMA_BAUD_MAX_ERROR_PPM
  *
  */
-void UART_DMA_EnableRxInterrupt(UART_DMA_QueueStruct *msg)
+static int UART_DMA_CheckBaudRate(UART_HandleTypeDef *huart, uint32_t baudRate, UART_DMA_BaudConfig *config)
 {
-	msg->rx.hal_status = HAL_UARTEx_ReceiveToIdle_DMA(msg->huart, msg->rx.queue[msg->rx.ptr.index_IN].data, UART_DMA_DATA_SIZE * 2);
+	if(UART_DMA_CalcBaudRate(huart, baudRate, config) != 0
+			|| config->errorPpm > UART_DMA_BAUD_MAX_ERROR_PPM || config->errorPpm < -UART_DMA_BAUD_MAX_ERROR_PPM)
+	{
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
- * Description: Call from polling routine
+ * Description: Called from UART_DMA_CheckRxInterruptErrorFlag once tx.baudReady is set, the messages before baudSwitchAt
+ * 				in every ring are sent and the last byte is out. Not called from interrupt since HAL_UART_AbortReceive
+ * 				and HAL_UART_Init wait on flags with a HAL_GetTick timeout. Tx stays held until it is done.
+ * 				HAL_UART_Init reprograms the port. It doesn't call HAL_UART_MspInit again since the port is initialized.
  *
  */
-void UART_DMA_CheckRxInterruptErrorFlag(UART_DMA_QueueStruct *msg)
+static void UART_DMA_ApplyBaudRate(UART_DMA_QueueStruct *msg)
 {
-	if(msg->rx.hal_status != HAL_OK)
+	msg->tx.baudPending = false;
+
+	HAL_UART_AbortReceive(msg->huart);
+
+	msg->huart->Init.BaudRate = msg->tx.baudConfig.baudRate;
+	msg->huart->Init.ClockPrescaler = msg->tx.baudConfig.clockPrescaler;
+	if(!UART_INSTANCE_LOWPOWER(msg->huart))
+	{
+		msg->huart->Init.OverSampling = msg->tx.baudConfig.overSampling;
+	}
+
+	if(HAL_UART_Init(msg->huart) != HAL_OK)
+	{
+		msg->rx.hal_status = HAL_ERROR; // UART_DMA_CheckRxInterruptErrorFlag will try to enable rx again
+	}
+	else
+	{
+		UART_DMA_EnableRxInterrupt(msg);
+	}
+
+	msg->tx.baudReady = false;
+	UART_DMA_SendMessage(msg); // send what was queued after UART_DMA_SetBaudRate
+}
+
+/*
+ * Description: Return the kernel clock of the port, same as the HAL does in UART_SetConfig
+ *
+ */
+static uint32_t UART_DMA_GetKernelClock(UART_HandleTypeDef *huart)
+{
+	UART_ClockSourceTypeDef clocksource;
+
+	UART_GETCLOCKSOURCE(huart, clocksource);
+
+	switch(clocksource)
+	{
+	case UART_CLOCKSOURCE_PCLK1:
+		return HAL_RCC_GetPCLK1Freq();
+	case UART_CLOCKSOURCE_PCLK2:
+		return HAL_RCC_GetPCLK2Freq();
+	case UART_CLOCKSOURCE_HSI:
+		return HSI_VALUE;
+	case UART_CLOCKSOURCE_SYSCLK:
+		return HAL_RCC_GetSysClockFreq();
+	case UART_CLOCKSOURCE_LSE:
+		return LSE_VALUE;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Description: Let the USART measure the baud rate of the incoming data, then start rx at that rate.
+ * 				mode is one of the HAL auto baud modes:
+ * 				UART_ADVFEATURE_AUTOBAUDRATE_ONSTARTBIT, first character starts with a 1 bit after the start bit
+ * 				UART_ADVFEATURE_AUTOBAUDRATE_ONFALLINGEDGE, first character starts with 10xx
+ * 				UART_ADVFEATURE_AUTOBAUDRATE_ON0X7FFRAME, sender sends 0x7F
+ * 				UART_ADVFEATURE_AUTOBAUDRATE_ON0X55FRAME, sender sends 0x55
+ * 				The first character is used for the measurement and is discarded. It is handled from its rx interrupt,
+ * 				where rx DMA is started right away. Only a byte that has already started by then is lost, i.e. one sent
+ * 				back to back with the measurement character while the interrupt is held off. The sender should leave
+ * 				a gap of one character after it. Tx messages are held until the rate is known. rx.autoBaudRate is set when done.
+ * 				If a transfer is in progress, detection starts once it is complete so it isn't cut off.
+ * 				Returns -1 if the port has no auto baud detection (LPUART1) or the port couldn't be initialized.
+ * 	example:
+ * 		UART_DMA_AutoBaudStart(&uart4, UART_ADVFEATURE_AUTOBAUDRATE_ON0X7FFRAME);
+ *
+ */
+int UART_DMA_AutoBaudStart(UART_DMA_QueueStruct *msg, uint32_t mode)
+{
+	if(!IS_USART_AUTOBAUDRATE_DETECTION_INSTANCE(msg->huart->Instance))
+	{
+		return -1;
+	}
+
+	msg->rx.autoBaudMode = mode;
+	msg->rx.autoBaudRate = 0;
+	msg->rx.autoBaudArmed = false;
+	msg->rx.autoBaud = true; // no new transfer is started from here on
+
+	return UART_DMA_AutoBaudArm(msg);
+}
+
+/*
+ * Description: Start auto baud detection if tx is idle, otherwise UART_DMA_AutoBaudPoll tries again.
+ * 				HAL_UART_Init would stop a tx DMA in progress and tx complete would never be called.
+ * 				Returns -1 if HAL_UART_Init failed.
+ *
+ */
+static int UART_DMA_AutoBaudArm(UART_DMA_QueueStruct *msg)
+{
+	if(msg->tx.txPending)
+	{
+		return 0;
+	}
+
+	HAL_UART_AbortReceive(msg->huart);
+
+	msg->huart->AdvancedInit.AdvFeatureInit |= UART_ADVFEATURE_AUTOBAUDRATE_INIT;
+	msg->huart->AdvancedInit.AutoBaudRateEnable = UART_ADVFEATURE_AUTOBAUDRATE_ENABLE;
+	msg->huart->AdvancedInit.AutoBaudRateMode = msg->rx.autoBaudMode;
+
+	if(HAL_UART_Init(msg->huart) != HAL_OK)
+	{
+		msg->rx.autoBaud = false;
+		msg->rx.hal_status = HAL_ERROR;
+		return -1;
+	}
+
+	msg->rx.autoBaudArmed = true;
+	msg->huart->RxISR = UART_DMA_AutoBaudISR; // HAL_UART_IRQHandler calls it on rx not empty
+	__HAL_UART_ENABLE_IT(msg->huart, UART_IT_RXNE);
+
+	return 0;
+}
+
+/*
+ * Description: Called from UART_DMA_CheckRxInterruptErrorFlag. Arms detection once tx is idle.
+ * 				Detection itself is done in UART_DMA_AutoBaudISR.
+ *
+ */
+static void UART_DMA_AutoBaudPoll(UART_DMA_QueueStruct *msg)
+{
+	if(!msg->rx.autoBaudArmed)
+	{
+		UART_DMA_AutoBaudArm(msg); // waiting for tx to be idle
+	}
+}
+
+/*
+ * Description: Set as huart->RxISR while detection is armed, so it is called from HAL_UART_IRQHandler when the measurement character is in.
+ * 				On error a new detection is requested. When done the rate is read back from BRR, the measurement character is flushed
+ * 				and rx DMA is started here, not from the polling routine, so the bytes after it aren't overrun.
+ *
+ */
+static void UART_DMA_AutoBaudISR(UART_HandleTypeDef *huart)
+{
+	UART_DMA_QueueStruct *msg = UART_DMA_GetPort(huart);
+	uint32_t clockPres;
+	uint32_t brr;
+
+	if(msg == NULL || !msg->rx.autoBaudArmed)
+	{
+		__HAL_UART_SEND_REQ(huart, UART_RXDATA_FLUSH_REQUEST);
+		return;
+	}
+
+	brr = huart->Instance->BRR;
+	if(__HAL_UART_GET_FLAG(huart, UART_FLAG_ABRE) || !__HAL_UART_GET_FLAG(huart, UART_FLAG_ABRF) || brr == 0)
+	{
+		msg->rx.autoBaudErrors++;
+		__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF);
+		__HAL_UART_SEND_REQ(huart, UART_RXDATA_FLUSH_REQUEST); // clears rx not empty
+		__HAL_UART_SEND_REQ(huart, UART_AUTOBAUD_REQUEST); // try again on the next character
+		return;
+	}
+
+	clockPres = UART_DMA_GetKernelClock(huart) / UARTPrescTable[huart->Init.ClockPrescaler];
+	if(huart->Init.OverSampling == UART_OVERSAMPLING_8)
+	{
+		brr = (brr & 0xFFF0) | ((brr & 0x0007) << 1); // back to the usartdiv value
+		clockPres *= 2;
+	}
+
+	msg->rx.autoBaudRate = clockPres / brr;
+	huart->Init.BaudRate = msg->rx.autoBaudRate;
+
+	__HAL_UART_DISABLE_IT(huart, UART_IT_RXNE);
+	huart->RxISR = NULL;
+
+	// turn detection off so the next HAL_UART_Init, i.e. from UART_DMA_ApplyBaudRate, doesn't start it again.
+	// ABREN can only be changed with UE cleared
+	huart->AdvancedInit.AdvFeatureInit &= ~UART_ADVFEATURE_AUTOBAUDRATE_INIT;
+	huart->AdvancedInit.AutoBaudRateEnable = UART_ADVFEATURE_AUTOBAUDRATE_DISABLE;
+	__HAL_UART_DISABLE(huart);
+	CLEAR_BIT(huart->Instance->CR2, USART_CR2_ABREN);
+	__HAL_UART_ENABLE(huart);
+
+	__HAL_UART_SEND_REQ(huart, UART_RXDATA_FLUSH_REQUEST);
+	__HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF | UART_CLEAR_FEF | UART_CLEAR_NEF);
+
+	msg->rx.autoBaudArmed = false;
+	msg->rx.autoBaud = false;
+	if(huart->ErrorCode != HAL_UART_ERROR_NONE)
+	{
+		msg->rx.hal_status = HAL_ERROR; // HAL_UART_IRQHandler ends rx after this returns, UART_DMA_CheckRxInterruptErrorFlag starts it again
+	}
+	else
 	{
 		msg->rx.hal_status = HAL_OK;
 		UART_DMA_EnableRxInterrupt(msg);
 	}
+
+	UART_DMA_SendMessage(msg); // send what was held
+}
+
+/*
+ * Description: Every UART_DMA_STATS_SAMPLE_TIME, sample the byte counters and update the bytes per second
+ * 				from the oldest sample in the window. Called from UART_DMA_CheckRxInterruptErrorFlag.
+ *
+ */
+static void UART_DMA_StatsUpdate(UART_DMA_QueueStruct *msg)
+{
+	UART_DMA_Stats *stats = &msg->stats;
+	uint32_t index;
+
+	if(HAL_GetTick() - stats->sampleTick < UART_DMA_STATS_SAMPLE_TIME)
+	{
+		return;
+	}
+	stats->sampleTick += UART_DMA_STATS_SAMPLE_TIME;
+	if(HAL_GetTick() - stats->sampleTick >= UART_DMA_STATS_SAMPLE_TIME)
+	{
+		stats->sampleTick = HAL_GetTick(); // first call or the loop was held up, start over from now
+	}
+
+	index = stats->sampleIndex % UART_DMA_STATS_SAMPLES; // oldest sample, replaced by the new one
+	stats->rxBytesPerSecond = ((stats->rxBytes - stats->rxSample[index]) * 1000) / (UART_DMA_STATS_SAMPLES * UART_DMA_STATS_SAMPLE_TIME);
+	stats->txBytesPerSecond = ((stats->txBytes - stats->txSample[index]) * 1000) / (UART_DMA_STATS_SAMPLES * UART_DMA_STATS_SAMPLE_TIME);
+	stats->rxSample[index] = stats->rxBytes;
+	stats->txSample[index] = stats->txBytes;
+	stats->sampleIndex++;
 }
 
+/*
+ * Description: Clear the counters and high water marks, including rx.overflow and tx.overflow
+ *
+ */
+void UART_DMA_StatsReset(UART_DMA_QueueStruct *msg)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	memset(&msg->stats, 0, sizeof(UART_DMA_Stats));
+	msg->rx.overflow = 0;
+	msg->rx.rejected = 0;
+	msg->rx.smallHighWater = 0;
+	msg->rx.largeHighWater = 0;
+	msg->tx.overflow = 0;
+	__set_PRIMASK(primask);
+}
 
 /*
- * Description: Return 0 if no new message, 1 if there is message in msgOut
+ * Description: Queue a UART_DMA_StatsPacket with the counters of msg on port to. port is an id so the host can tell ports apart.
+ * 				Returns -1 if there isn't room in the tx ring.
+ * 	example:
+ * 		UART_DMA_StatsSend(&uart2, &uart1, 1);
+ *
  */
-int UART_DMA_MsgRdy(UART_DMA_QueueStruct *msg)
+int UART_DMA_StatsSend(UART_DMA_QueueStruct *to, UART_DMA_QueueStruct *msg, uint8_t port)
 {
-	if(msg->rx.ptr.cnt_Handle)
+	UART_DMA_StatsPacket packet;
+	uint8_t *ptr = (uint8_t *)&packet;
+	uint8_t checksum = 0;
+	uint32_t count;
+	uint32_t i;
+
+	packet.sync[0] = 0xA5;
+	packet.sync[1] = 0x5A;
+	packet.version = UART_DMA_STATS_VERSION;
+	packet.port = port;
+	packet.rxFrames = msg->stats.rxFrames;
+	packet.rxBytes = msg->stats.rxBytes;
+	packet.rxOverflow = msg->rx.overflow;
+	packet.rxBusyRetries = msg->stats.rxBusyRetries;
+	packet.rxQueueHighWater = msg->stats.rxQueueHighWater;
+	packet.rxSmallHighWater = msg->rx.smallHighWater;
+	packet.rxLargeHighWater = msg->rx.largeHighWater;
+	packet.rxBytesPerSecond = msg->stats.rxBytesPerSecond;
+	packet.txMessages = msg->stats.txMessages;
+	packet.txTransfers = msg->stats.txTransfers;
+	packet.txBytes = msg->stats.txBytes;
+	packet.txOverflow = msg->tx.overflow;
+	packet.txRingHighWater = msg->stats.txRingHighWater;
+	packet.txBytesPerSecond = msg->stats.txBytesPerSecond;
+	packet.txExpired = msg->stats.txExpired;
+	for(i = 0; i < UART_DMA_TX_PRIORITIES; i++)
+	{
+		count = msg->stats.txLatencyCount[i];
+		packet.txLatencyMean[i] = count ? msg->stats.txLatencyTotal[i] / count : 0;
+		packet.txLatencyMax[i] = msg->stats.txLatencyMax[i];
+	}
+
+	for(i = 0; i < sizeof(UART_DMA_StatsPacket) - 1; i++)
+	{
+		checksum += ptr[i];
+	}
+	packet.checksum = checksum;
+
+	if(UART_DMA_TX_AddMessageToBuffer(to, ptr, sizeof(UART_DMA_StatsPacket)) != 0)
 	{
-		msg->rx.msgToParse = &msg->rx.queue[msg->rx.ptr.index_OUT];
-		RingBuff_Ptr_Output(&msg->rx.ptr, UART_DMA_QUEUE_SIZE);
-		return 1;
+		return -1;
 	}
 
+	UART_DMA_SendMessage(to);
+
 	return 0;
 }
 
 /*
-* Description: Add message to TX buffer
-*/
-void UART_DMA_TX_AddMessageToBuffer(UART_DMA_QueueStruct *msg, uint8_t *data, uint32_t size)
+ * Description: Ask the other end to change baud rate. Sends "BAUD <rate>". The other end answers "BAUD OK <rate>"
+ * 				at the old rate and then switches. When the answer is received, UART_DMA_BaudCommand switches this end.
+ * 				Returns -1 if this port can't do baudRate.
+ *
+ */
+int UART_DMA_BaudNegotiate(UART_DMA_QueueStruct *msg, uint32_t baudRate)
 {
-	UART_DMA_Data *ptr = &msg->tx.queue[msg->tx.ptr.index_IN];
+	UART_DMA_BaudConfig config;
+
+	if(UART_DMA_CheckBaudRate(msg->huart, baudRate, &config) != 0)
+	{
+		return -1;
+	}
 
-	memcpy(ptr->data, data, size);
-	ptr->size = size;
+	msg->tx.baudRequested = baudRate;
 
-    RingBuff_Ptr_Input(&msg->tx.ptr, UART_DMA_QUEUE_SIZE);
+	return (UART_DMA_Printf(msg, "BAUD %u\r\n", baudRate) < 0) ? -1 : 0;
 }
 
 /*
- * Description: This will be called from UART_DMA_NotifyUser or from HAL_UART_TxCpltCallback
+ * Description: Call from the parser with each received frame. Returns true if the frame was a baud command and was handled.
+ * 				Only call it on ports that negotiate, i.e. not on the ST-Link VCP where typed text could change the rate.
+ * 				"BAUD <rate>" from the other end is answered with "BAUD OK <rate>" and the port switches once that is sent,
+ * 				or with "BAUD ERR <rate>" if the rate can't be done or the answer doesn't fit in the tx ring.
+ * 				The port never switches without the answer queued, so the two ends can't end up at different rates.
+ * 				"BAUD OK <rate>" is the answer to UART_DMA_BaudNegotiate, the port switches now.
  *
  */
-void UART_DMA_SendMessage(UART_DMA_QueueStruct * msg)
+bool UART_DMA_BaudCommand(UART_DMA_QueueStruct *msg, UART_DMA_RxFrame *frame)
 {
-	if(msg->tx.ptr.cnt_Handle)
+	UART_DMA_BaudConfig config;
+	char str[24];
+	char *ptr;
+	uint32_t baudRate;
+	uint32_t size = (frame->size < sizeof(str) - 1) ? frame->size : sizeof(str) - 1;
+
+	if(frame->size < 6 || strncmp((char *)frame->data, "BAUD ", 5) != 0)
+	{
+		return false;
+	}
+
+	memcpy(str, frame->data, size);
+	str[size] = 0;
+	ptr = &str[5];
+
+	if(strncmp(ptr, "OK ", 3) == 0)
 	{
-		//if(msg->huart->gState == HAL_UART_STATE_READY) // this hasn't been tested yet but could take place of txPending
-		if(!msg->tx.txPending) // If no message is being sent then send message in queue
+		baudRate = strtoul(&ptr[3], NULL, 10);
+		if(baudRate != 0 && baudRate == msg->tx.baudRequested)
 		{
-			if(HAL_UART_Transmit_DMA(msg->huart, msg->tx.queue[msg->tx.ptr.index_OUT].data, msg->tx.queue[msg->tx.ptr.index_OUT].size) == HAL_OK)
-			{
-				msg->tx.txPending = true;
-				RingBuff_Ptr_Output(&msg->tx.ptr, UART_DMA_QUEUE_SIZE);
-			}
+			msg->tx.baudRequested = 0;
+			UART_DMA_SetBaudRate(msg, baudRate, NULL);
+		}
+	}
+	else if(strncmp(ptr, "ERR", 3) == 0)
+	{
+		msg->tx.baudRequested = 0;
+	}
+	else
+	{
+		baudRate = strtoul(ptr, NULL, 10);
+		if(UART_DMA_CheckBaudRate(msg->huart, baudRate, &config) == 0 && UART_DMA_Printf(msg, "BAUD OK %u\r\n", baudRate) > 0)
+		{
+			UART_DMA_SetBaudRate(msg, baudRate, NULL); // switches after the answer is sent
+		}
+		else // can't do the rate, or no room for the answer. Either way stay at this rate
+		{
+			UART_DMA_Printf(msg, "BAUD ERR %u\r\n", baudRate);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Description: Call from HAL_UART_TxCpltCallback.
+ * 				Release the zero copy buffer that was sent, free the ring space, clear the txPending flag and send the next message.
+ *
+ */
+void UART_DMA_TxCplt(UART_DMA_QueueStruct *msg)
+{
+	uint32_t primask;
+
+	if(msg->tx.bufferInFlight)
+	{
+		UART_DMA_TxBufferRelease(msg->tx.bufferInFlight);
+		msg->tx.bufferInFlight = NULL;
+	}
+
+	msg->tx.queue[msg->tx.inFlightPriority].tail += msg->tx.inFlightBytes;
+	msg->tx.inFlightBytes = 0;
+
+	msg->tx.txPending = false;
+	UART_DMA_SendMessage(msg);
+
+	if(msg->tx.callback)
+	{
+		primask = __get_PRIMASK();
+		__disable_irq();
+		uartDMA_TxReadyPorts |= UART_DMA_PortMask(msg);
+		__set_PRIMASK(primask);
+	}
+}
+
+/*
+ * Description: Get a free buffer from the pool with refCount of 1. Returns NULL if the pool is empty.
+ * 				Fill in data and size, then pass it to UART_DMA_TX_AddBufferToQueue.
+ *
+ */
+UART_DMA_TxBuffer * UART_DMA_TxBufferAlloc(void)
+{
+	UART_DMA_TxBuffer *buffer = NULL;
+	uint32_t primask = __get_PRIMASK();
+	int i;
+
+	__disable_irq();
+	for(i = 0; i < UART_DMA_TX_BUFFER_POOL_SIZE; i++)
+	{
+		if(txBufferPool[i].refCount == 0)
+		{
+			buffer = &txBufferPool[i];
+			buffer->refCount = 1;
+			break;
 		}
 	}
+	__set_PRIMASK(primask);
+
+	if(buffer)
+	{
+		buffer->data = txBufferPoolData[i];
+		buffer->size = 0;
+		buffer->release = NULL;
+		buffer->owner = NULL;
+	}
+
+	return buffer;
+}
+
+/*
+ * Description: Add a reference. Use this when queuing the same buffer to more than one port.
+ *
+ */
+void UART_DMA_TxBufferRetain(UART_DMA_TxBuffer *buffer)
+{
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	buffer->refCount++;
+	__set_PRIMASK(primask);
+}
+
+/*
+ * Description: Drop a reference. When the last reference is dropped the release callback is called,
+ * 				or if there isn't one, the buffer is back in the pool.
+ *
+ */
+void UART_DMA_TxBufferRelease(UART_DMA_TxBuffer *buffer)
+{
+	uint32_t refCount;
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if(buffer->refCount)
+	{
+		buffer->refCount--;
+	}
+	refCount = buffer->refCount;
+	__set_PRIMASK(primask);
+
+	if(refCount == 0 && buffer->release != NULL)
+	{
+		buffer->release(buffer);
+	}
 }
 
 /*
-* Description: Add string to TX structure
+* Description: Add string to TX structure. The string is copied once, directly into the tx ring.
+* 				A long string is split into fragments like UART_DMA_TX_AddMessageToBuffer.
+* 				Returns 0 if added, -1 if there isn't enough room in the ring.
 */
-void UART_DMA_NotifyUser(UART_DMA_QueueStruct *msg, char *str, uint32_t size, bool lineFeed)
+int UART_DMA_NotifyUser(UART_DMA_QueueStruct *msg, char *str, uint32_t size, bool lineFeed)
+{
+	UART_DMA_TxSegment segments[2] = {{(uint8_t *)str, size}, {(uint8_t *)"\r\n", 2}};
+
+	if(UART_DMA_TX_AddSegments(msg, UART_DMA_TX_PRIORITY_NORMAL, 0, segments, (lineFeed == true) ? 2 : 1) != 0) // add message and CR LF to queue
+	{
+		return -1;
+	}
+
+	UART_DMA_SendMessage(msg); // Try to send message if !msg->tx.txPending
+
+	return 0;
+}
+
+
+/*
+ * Description: HAL calls this on idle, half transfer and transfer complete. Look up the port and pass the event on.
+ *
+ */
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
 {
-	uint8_t strMsg[UART_DMA_DATA_SIZE] = {0};
+	PROFILE_START(PROFILE_RX_ISR);
+	UART_DMA_QueueStruct *msg = UART_DMA_GetPort(huart);
 
-    strcpy((char*)strMsg, str);
-    
-    if(lineFeed == true)
-    {
-    	strcat((char*)strMsg, "\r\n");
-    	size += 2; // add 2 due to CR and LF
-    }
+	if(msg)
+	{
+		UART_DMA_RxEvent(msg, Size);
+	}
+	PROFILE_END(PROFILE_RX_ISR);
+}
 
-    UART_DMA_TX_AddMessageToBuffer(msg, strMsg, size); // add message to queue
+/*
+ * Description: The HAL driver calls this callback when it finishes transmitting. Look up the port and send the next message.
+ *
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	PROFILE_START(PROFILE_TX_ISR);
+	UART_DMA_QueueStruct *msg = UART_DMA_GetPort(huart);
 
-    UART_DMA_SendMessage(msg); // Try to send message if !msg->tx.txPending
+	if(msg)
+	{
+		UART_DMA_TxCplt(msg);
+	}
+	PROFILE_END(PROFILE_TX_ISR);
 }
 
 
@@ -135,35 +2632,13 @@ void UART_CheckForNewMessage(UART_DMA_QueueStruct *msg)
 	}
 }
 
-// Here are callbacks that should be placed in your polling routine or interrupt routine.
- * This is for uart1. If you have more UART instances then test for those.
-
-void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
-{
-	if(huart == uart1.huart)
-	{
-		RingBuff_Ptr_Input(&uart1.rx.ptr, uart1.rx.queueSize);
-		UART_DMA_EnableRxInterrupt(&uart1);
-	}
-	else if(huart == uart2.huart)
-	{
-		RingBuff_Ptr_Input(&uart2.rx.ptr, uart2.rx.queueSize);
-		UART_DMA_EnableRxInterrupt(&uart2);
-	}
-}
+// The HAL_UARTEx_RxEventCallback and HAL_UART_TxCpltCallback are in this file.
+ * Each UART instance only needs to be registered once before enabling the rx interrupt.
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+void PollingInit(void)
 {
-	if(huart == uart1.huart)
-	{
-		uart1.tx.txPending = false;
-		UART_DMA_SendMessage(&uart1);
-	}
-	else if(huart == uart2.huart)
-	{
-		uart2.tx.txPending = false;
-		UART_DMA_SendMessage(&uart2);
-	}
+	UART_DMA_Register(&uart1);
+	UART_DMA_EnableRxInterrupt(&uart1);
 }
 
 // Be sure to initialize UART instance in polling routine
@@ -172,10 +2647,12 @@ UART_DMA_QueueStruct uart1 =
 {
 	.huart = &hlpuart1,
 	.rx.queueSize = UART_DMA_QUEUE_SIZE,
-	.tx.queueSize = UART_DMA_QUEUE_SIZE
+	.rx.circularMode = true, // optional, gap-free reception with one continuous circular DMA
+	.rx.rtsPort = GPIOA, // optional, RTS deasserted when rx slots run low. PA1 configured as GPIO output
+	.rx.rtsPin = GPIO_PIN_1,
+	.rx.cutThroughSize = 32, // optional, circular mode only. Queue partial frames every 32 bytes and on half/full transfer
+	.tx.coalesceMode = true // optional, merge pending messages into one transfer
 };
 
 
  */
-
-